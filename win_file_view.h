@@ -0,0 +1,128 @@
+// win_file_view.h - read-only memory mapped file
+#pragma once
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <memoryapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <cstddef>
+#include "xll24/include/ensure.h"
+
+namespace Win {
+
+	// Map a whole file read-only. Pages are read by the OS as they are touched
+	// so files larger than physical memory can be scanned.
+	class file_view {
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE map = NULL;
+#else
+		int fd = -1;
+#endif
+		const char* buf = nullptr;
+		size_t len = 0;
+
+		void close()
+		{
+#ifdef _WIN32
+			if (buf) {
+				UnmapViewOfFile(buf);
+			}
+			if (map) {
+				CloseHandle(map);
+			}
+			if (file != INVALID_HANDLE_VALUE) {
+				CloseHandle(file);
+			}
+			map = NULL;
+			file = INVALID_HANDLE_VALUE;
+#else
+			if (buf) {
+				munmap(const_cast<char*>(buf), len);
+			}
+			if (fd != -1) {
+				::close(fd);
+			}
+			fd = -1;
+#endif
+			buf = nullptr;
+			len = 0;
+		}
+	public:
+		// An empty file has a null data() and size() 0.
+		explicit file_view(const char* path)
+		{
+			bool ok = false;
+#ifdef _WIN32
+			file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+				FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			LARGE_INTEGER size;
+			if (file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &size)) {
+				len = static_cast<size_t>(size.QuadPart);
+				if (len == 0) {
+					ok = true;
+				}
+				else if (NULL != (map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL))) {
+					buf = static_cast<const char*>(MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0));
+					ok = buf != nullptr;
+				}
+			}
+#else
+			fd = open(path, O_RDONLY);
+			struct stat st;
+			if (fd != -1 && 0 == fstat(fd, &st)) {
+				len = static_cast<size_t>(st.st_size);
+				if (len == 0) {
+					ok = true;
+				}
+				else {
+					void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+					if (p != MAP_FAILED) {
+						madvise(p, len, MADV_SEQUENTIAL);
+						buf = static_cast<const char*>(p);
+						ok = true;
+					}
+				}
+			}
+#endif
+			if (!ok) {
+				close();
+				ensure(!"file_view: failed to map file");
+			}
+		}
+		file_view(const file_view&) = delete;
+		file_view& operator=(const file_view&) = delete;
+		~file_view()
+		{
+			close();
+		}
+
+		const char* data() const
+		{
+			return buf;
+		}
+		size_t size() const
+		{
+			return len;
+		}
+		const char* begin() const
+		{
+			return buf;
+		}
+		const char* end() const
+		{
+			return buf + len;
+		}
+	};
+
+} // namespace Win
@@ -1,62 +1,230 @@
-// win_mem_view.cpp - memory mapped data
+// win_mem_view.h - reserved virtual memory committed on demand
+#pragma once
+#ifdef _WIN32
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <memoryapi.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include "xll24/include/ensure.h"
 
 namespace Win {
 
+	// Platform virtual memory primitives.
+	namespace vm {
+
+#ifdef _WIN32
+		inline size_t page_size()
+		{
+			static const size_t size = []() {
+				SYSTEM_INFO si;
+				GetSystemInfo(&si);
+				return static_cast<size_t>(si.dwPageSize);
+			}();
+
+			return size;
+		}
+		// Reserve address space without backing store.
+		inline void* reserve(size_t n)
+		{
+			return VirtualAlloc(nullptr, n, MEM_RESERVE, PAGE_NOACCESS);
+		}
+		// Back [p, p + n) with read/write pages.
+		inline bool commit(void* p, size_t n)
+		{
+			return nullptr != VirtualAlloc(p, n, MEM_COMMIT, PAGE_READWRITE);
+		}
+		// Return [p, p + n) to the reserved state.
+		inline void decommit(void* p, size_t n)
+		{
+#pragma warning(suppress: 6250)
+			VirtualFree(p, n, MEM_DECOMMIT);
+		}
+		inline void release(void* p, size_t)
+		{
+			VirtualFree(p, 0, MEM_RELEASE);
+		}
+#else
+		inline size_t page_size()
+		{
+			static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+			return size;
+		}
+		inline void* reserve(size_t n)
+		{
+			void* p = mmap(nullptr, n, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+			return p == MAP_FAILED ? nullptr : p;
+		}
+		inline bool commit(void* p, size_t n)
+		{
+			return 0 == mprotect(p, n, PROT_READ | PROT_WRITE);
+		}
+		inline void decommit(void* p, size_t n)
+		{
+			madvise(p, n, MADV_DONTNEED);
+			mprotect(p, n, PROT_NONE);
+		}
+		inline void release(void* p, size_t n)
+		{
+			munmap(p, n);
+		}
+#endif // _WIN32
+
+		// Round n up to a multiple of the page size.
+		inline size_t round_page(size_t n)
+		{
+			const size_t p = page_size();
+
+			return ((n + p - 1) / p) * p;
+		}
+
+	} // namespace vm
+
+	// Growable buffer over a virtual reservation.
+	// Pages are committed as append grows so pointers into buf stay valid.
+	// Each view has its own reservation since address space costs nothing until committed.
 	template<class T>
 	class mem_view {
-		HANDLE h;
-		DWORD max_len;
+		static_assert(std::is_trivially_copyable_v<T>);
+
+		size_t max_len; // reserved elements
+		size_t span;    // reserved bytes, page aligned
+		size_t bytes;   // committed bytes, page aligned
+		size_t cap;     // committed elements
 	public:
+		// Bytes of address space reserved by default.
+		static constexpr size_t default_reserve = sizeof(void*) == 8 ? (size_t(1) << 36) : (size_t(1) << 28);
+		// Smallest commit increment in bytes.
+		static constexpr size_t min_commit = 1 << 16;
+
 		T* buf;
-		DWORD len;
+		size_t len;
 
 		/// <summary>
-		/// Map file of temporary anonymous memory.
+		/// Reserve default_reserve bytes, or as much of it as the process has room for.
 		/// </summary>
-		/// <param name="h">optional handle to file</param>
-		/// <param name="len">initial size of buffer</param>
-		mem_view(HANDLE h_ = INVALID_HANDLE_VALUE, DWORD max_len = 1 << 25)
-			: h(CreateFileMapping(h_, 0, PAGE_READWRITE, 0, max_len * sizeof(T), nullptr)), 
-			  max_len(max_len), buf(nullptr), len(0)
-		{
-			if (h != NULL) {
-				buf = (T*)MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, len * sizeof(T));
+		mem_view()
+			: max_len(0), span(0), bytes(0), cap(0), buf(nullptr), len(0)
+		{
+			for (size_t n = default_reserve; !buf && n >= min_commit; n /= 2) {
+				buf = static_cast<T*>(vm::reserve(n));
+				if (buf) {
+					span = n;
+					max_len = span / sizeof(T);
+				}
 			}
+			ensure(buf || !"mem_view: failed to reserve address space");
 		}
-		mem_view(const mem_view&) = delete;
-		mem_view(mem_view&& mv) noexcept
+		/// <summary>
+		/// Reserve address space for exactly max_len elements. Nothing is committed until used.
+		/// A zero length view reserves nothing and only accepts empty appends.
+		/// </summary>
+		/// <param name="max_len">maximum number of elements</param>
+		explicit mem_view(size_t max_len)
+			: max_len(max_len), span(0), bytes(0), cap(0), buf(nullptr), len(0)
 		{
-			*this = std::move(mv);
+			if (max_len) {
+				span = vm::round_page(max_len * sizeof(T));
+				buf = static_cast<T*>(vm::reserve(span));
+				ensure(buf || !"mem_view: failed to reserve address space");
+			}
 		}
+		mem_view(const mem_view&) = delete;
+		mem_view(mem_view&& mv) noexcept
+			: max_len(std::exchange(mv.max_len, 0)), span(std::exchange(mv.span, 0)),
+			  bytes(std::exchange(mv.bytes, 0)), cap(std::exchange(mv.cap, 0)),
+			  buf(std::exchange(mv.buf, nullptr)), len(std::exchange(mv.len, 0))
+		{ }
 		mem_view& operator=(const mem_view&) = delete;
 		mem_view& operator=(mem_view&& mv) noexcept
 		{
 			if (this != &mv) {
-				h = std::exchange(mv.h, INVALID_HANDLE_VALUE);
-				buf = std::exchange(mv.buf, nullptr);
-				len = std::exchange(mv.len, 0);
+				std::swap(max_len, mv.max_len);
+				std::swap(span, mv.span);
+				std::swap(bytes, mv.bytes);
+				std::swap(cap, mv.cap);
+				std::swap(buf, mv.buf);
+				std::swap(len, mv.len);
 			}
 
 			return *this;
 		}
 		~mem_view()
 		{
-			if (buf) UnmapViewOfFile(buf);
-			if (h) CloseHandle(h);
+			if (buf) {
+				vm::release(buf, span);
+			}
 		}
 
-		mem_view& reset(DWORD _len = 0)
+		mem_view& reset(size_t _len = 0)
 		{
+			ensure(_len <= cap);
 			len = _len;
 
 			return *this;
 		}
 
+		size_t size() const
+		{
+			return len;
+		}
+		// committed elements
+		size_t capacity() const
+		{
+			return cap;
+		}
+		// reserved elements
+		size_t max_size() const
+		{
+			return max_len;
+		}
+
+		// Commit at least n elements.
+		mem_view& reserve(size_t n)
+		{
+			if (n > cap) {
+				ensure(buf || !"mem_view: no address space reserved");
+
+				if (n > max_len) {
+					throw std::length_error("mem_view: reserved address space exhausted at " + std::to_string(span) + " bytes");
+				}
+				size_t want = vm::round_page(std::max({ n * sizeof(T), 2 * bytes, bytes + min_commit }));
+				want = std::min(want, span);
+
+				ensure(vm::commit(reinterpret_cast<char*>(buf) + bytes, want - bytes)
+					|| !"mem_view: failed to commit memory");
+				bytes = want;
+				cap = std::min(bytes / sizeof(T), max_len);
+			}
+
+			return *this;
+		}
+
+		// Decommit pages above max(n, len) elements.
+		mem_view& shrink(size_t n = 0)
+		{
+			const size_t keep = vm::round_page(std::max(n, len) * sizeof(T));
+
+			if (keep < bytes) {
+				vm::decommit(reinterpret_cast<char*>(buf) + keep, bytes - keep);
+				bytes = keep;
+				cap = std::min(bytes / sizeof(T), max_len);
+			}
+
+			return *this;
+		}
+
 		operator T* ()
 		{
 			return buf;
@@ -76,13 +244,10 @@ namespace Win {
 		}
 
 		// Write to buffered memory.
-		mem_view& append(const T* s, DWORD n)
+		mem_view& append(const T* s, size_t n)
 		{
-			if (len + n >= max_len) {
-				n = n;
-			}
-			ensure(h && len + n < max_len);
 			if (n) {
+				reserve(len + n);
 				std::copy(s, s + n, buf + len);
 				len += n;
 			}
@@ -91,7 +256,7 @@ namespace Win {
 		}
 		mem_view& append(const T* b, const T* e)
 		{
-			return append(b, (DWORD)(e - b));
+			return append(b, static_cast<size_t>(e - b));
 		}
 		mem_view& append(T t)
 		{
@@ -99,6 +264,93 @@ namespace Win {
 		}
 	};
 
-	// class alocator...
+#ifdef _DEBUG
+	inline int test_mem_view()
+	{
+		{
+			mem_view<int> mv(1 << 20);
+			ensure(mv.size() == 0);
+			ensure(mv.capacity() == 0);
+			ensure(mv.max_size() == 1 << 20);
+
+			const int* b = mv.buf;
+			for (int i = 0; i < 100000; ++i) {
+				mv.append(i);
+			}
+			ensure(mv.buf == b); // no relocation
+			ensure(mv.size() == 100000);
+			ensure(mv.capacity() >= mv.size());
+			ensure(mv.buf[99999] == 99999);
+
+			mv.reset();
+			ensure(mv.size() == 0);
+			mv.append(7);
+			ensure(mv.buf[0] == 7);
+
+			mv.shrink();
+			ensure(mv.capacity() < 100000);
+			ensure(mv.buf[0] == 7);
+			mv.append(8);
+			ensure(mv.buf[1] == 8);
+
+			mem_view<int> mv2(std::move(mv));
+			ensure(mv2.buf == b);
+			ensure(mv.buf == nullptr);
+		}
+		{
+			// default views have their own reservation and never overlap
+			mem_view<int> a, b;
+			const int* pa = a.buf;
+			ensure(a.max_size() >= 1000000);
+			for (int i = 0; i < 1000000; ++i) {
+				a.append(i);
+				b.append(-i);
+			}
+			ensure(a.buf == pa);
+			ensure(a.end() <= b.buf || b.end() <= a.buf);
+			ensure(a.buf[999999] == 999999 && b.buf[999999] == -999999);
+
+			// more than the reservation is a clear error and leaves the view intact
+			bool thrown = false;
+			try {
+				a.reserve(a.max_size() + 1);
+			}
+			catch (const std::length_error&) {
+				thrown = true;
+			}
+			ensure(thrown);
+			ensure(a.buf == pa && a.buf[999999] == 999999);
+		}
+		{
+			mem_view<char> mv(1 << 16);
+			bool thrown = false;
+			try {
+				std::string s((1 << 16) + 1, 'a');
+				mv.append(s.data(), s.size());
+			}
+			catch (const std::exception&) {
+				thrown = true;
+			}
+			ensure(thrown);
+		}
+		{
+			mem_view<char> mv(0);
+			ensure(mv.buf == nullptr);
+			mv.append("", size_t(0));
+			mv.shrink();
+			ensure(mv.size() == 0 && mv.end() == nullptr);
+			bool thrown = false;
+			try {
+				mv.append('a');
+			}
+			catch (const std::exception&) {
+				thrown = true;
+			}
+			ensure(thrown);
+		}
+
+		return 1;
+	}
+#endif // _DEBUG
 
-} // namespace Win
\ No newline at end of file
+} // namespace Win
@@ -0,0 +1,280 @@
+// xll_csv.h - delimited text scanning
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define XLL_CSV_SSE2
+#endif
+#include "xll24/include/ensure.h"
+
+namespace xll::csv {
+
+	struct options {
+		char delim = ',';
+		char quote = '"';
+		bool header = true; // first record has column names
+	};
+
+	// Field of a record. Quotes are removed from quoted fields but
+	// doubled quotes inside them are only collapsed by append.
+	struct field {
+		const char* data;
+		size_t size;
+		bool quoted = false;
+		bool escaped = false; // has doubled quotes
+
+		std::string_view view() const
+		{
+			return std::string_view(data, size);
+		}
+		bool empty() const
+		{
+			return size == 0 && !quoted;
+		}
+		// Append the unescaped text to s.
+		void append(std::string& s, char quote) const
+		{
+			if (!escaped) {
+				s.append(data, size);
+
+				return;
+			}
+			for (size_t i = 0; i < size; ++i) {
+				s.push_back(data[i]);
+				if (data[i] == quote) {
+					++i; // skip the second quote
+				}
+			}
+		}
+		std::string to_string(char quote) const
+		{
+			std::string s;
+			append(s, quote);
+
+			return s;
+		}
+	};
+
+	// First of a, b, '\n', or '\r' in [p, e), or e if none.
+	// Sixteen bytes are compared at a time when SSE2 is available.
+	inline const char* scan(const char* p, const char* e, char a, char b)
+	{
+#ifdef XLL_CSV_SSE2
+		const __m128i va = _mm_set1_epi8(a);
+		const __m128i vb = _mm_set1_epi8(b);
+		const __m128i vn = _mm_set1_epi8('\n');
+		const __m128i vr = _mm_set1_epi8('\r');
+		for (; e - p >= 16; p += 16) {
+			const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			const __m128i m = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)),
+				_mm_or_si128(_mm_cmpeq_epi8(x, vn), _mm_cmpeq_epi8(x, vr)));
+			if (const int bits = _mm_movemask_epi8(m)) {
+				return p + std::countr_zero(static_cast<unsigned>(bits));
+			}
+		}
+#endif
+		for (; p < e; ++p) {
+			if (*p == a || *p == b || *p == '\n' || *p == '\r') {
+				return p;
+			}
+		}
+
+		return e;
+	}
+
+	// Number of c in [p, e).
+	inline size_t count(const char* p, const char* e, char c)
+	{
+		size_t n = 0;
+#ifdef XLL_CSV_SSE2
+		const __m128i vc = _mm_set1_epi8(c);
+		for (; e - p >= 16; p += 16) {
+			const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			n += std::popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, vc))));
+		}
+#endif
+		for (; p < e; ++p) {
+			n += *p == c;
+		}
+
+		return n;
+	}
+
+	// Start of the first record after p, or e. The quote state at p is given by in_quote.
+	inline const char* next_record(const char* p, const char* e, char quote, bool in_quote)
+	{
+		while ((p = scan(p, e, quote, '\n')) < e) {
+			if (*p == quote) {
+				in_quote = !in_quote;
+			}
+			else if (*p == '\n' && !in_quote) {
+				return p + 1;
+			}
+			++p;
+		}
+
+		return e;
+	}
+
+	// Split [b, e) into at most k pieces starting at records. Quotes before each guess are
+	// counted in parallel so a piece never starts inside a quoted field spanning lines.
+	inline std::vector<const char*> chunks(const char* b, const char* e, size_t k, char quote)
+	{
+		static constexpr size_t min_chunk = 1 << 20;
+		const size_t n = static_cast<size_t>(e - b);
+		k = std::clamp<size_t>(n / min_chunk, 1, std::max<size_t>(k, 1));
+
+		std::vector<const char*> guess(k + 1);
+		for (size_t i = 0; i <= k; ++i) {
+			guess[i] = b + n / k * i;
+		}
+		guess[k] = e;
+
+		std::vector<size_t> quotes(k);
+		if (k > 1) {
+			std::vector<std::jthread> counters;
+			for (size_t i = 0; i < k; ++i) {
+				counters.emplace_back([&, i]() { quotes[i] = count(guess[i], guess[i + 1], quote); });
+			}
+		}
+
+		std::vector<const char*> cs{ b };
+		size_t parity = 0;
+		for (size_t i = 1; i < k; ++i) {
+			parity += quotes[i - 1];
+			const char* p = next_record(guess[i], e, quote, parity & 1);
+			if (p > cs.back() && p < e) {
+				cs.push_back(p);
+			}
+		}
+		cs.push_back(e);
+
+		return cs;
+	}
+
+	// Parse the record at p into fields and return the start of the next record.
+	// Records end with "\n", "\r\n", or "\r". A quote in an unquoted field is kept as is
+	// and text after a closing quote is ignored.
+	inline const char* record(const char* p, const char* e, const options& o, std::vector<field>& fs)
+	{
+		fs.clear();
+		for (;;) {
+			field f{ p, 0 };
+			if (p < e && *p == o.quote) {
+				f.quoted = true;
+				f.data = ++p;
+				for (;;) {
+					p = std::find(p, e, o.quote);
+					if (p + 1 < e && p[1] == o.quote) {
+						f.escaped = true;
+						p += 2;
+					}
+					else {
+						break;
+					}
+				}
+				f.size = static_cast<size_t>(p - f.data);
+				if (p < e) {
+					++p; // closing quote
+				}
+				if (p < e && *p != o.delim && *p != '\n' && *p != '\r') {
+					p = scan(p, e, o.delim, o.delim);
+				}
+			}
+			else {
+				while ((p = scan(p, e, o.delim, o.quote)) < e && *p == o.quote) {
+					++p;
+				}
+				f.size = static_cast<size_t>(p - f.data);
+			}
+			fs.push_back(f);
+
+			if (p == e) {
+				return e;
+			}
+			if (*p == o.delim) {
+				++p;
+
+				continue;
+			}
+			if (*p == '\r') {
+				++p;
+			}
+			if (p < e && *p == '\n') {
+				++p;
+			}
+
+			return p;
+		}
+	}
+
+	// Skip a UTF-8 byte order mark.
+	inline const char* skip_bom(const char* b, const char* e)
+	{
+		return e - b >= 3 && b[0] == '\xEF' && b[1] == '\xBB' && b[2] == '\xBF' ? b + 3 : b;
+	}
+
+#ifdef _DEBUG
+	inline int test_csv()
+	{
+		options o;
+		std::vector<field> fs;
+		{
+			const std::string_view s = "a,\"b,\"\"c\"\"\"\r\n,1\n\"x\ny\"";
+			const char* p = s.data();
+			const char* e = p + s.size();
+
+			p = record(p, e, o, fs);
+			ensure(fs.size() == 2);
+			ensure(fs[0].view() == "a");
+			ensure(fs[1].quoted && fs[1].escaped);
+			ensure(fs[1].to_string(o.quote) == "b,\"c\"");
+			ensure(*p == ',');
+			ensure(next_record(s.data(), e, o.quote, false) == p);
+
+			p = record(p, e, o, fs);
+			ensure(fs.size() == 2);
+			ensure(fs[0].empty());
+			ensure(fs[1].view() == "1");
+
+			p = record(p, e, o, fs);
+			ensure(p == e);
+			ensure(fs.size() == 1);
+			ensure(fs[0].view() == "x\ny");
+		}
+		{
+			const std::string_view s = "0123456789abcdef0123456789,abcdef\n";
+			ensure(scan(s.data(), s.data() + s.size(), ',', '"') == s.data() + 26);
+			ensure(count(s.data(), s.data() + s.size(), 'a') == 2);
+		}
+		{
+			// quoted newlines on every line
+			std::string s;
+			for (int i = 0; i < 200000; ++i) {
+				s.append(std::to_string(i)).append(",\"a\nb\",c\n");
+			}
+			const auto cs = chunks(s.data(), s.data() + s.size(), 4, o.quote);
+			ensure(cs.size() > 2);
+			size_t n = 0;
+			for (size_t k = 0; k + 1 < cs.size(); ++k) {
+				for (const char* p = cs[k]; p < cs[k + 1]; ++n) {
+					p = record(p, cs[k + 1], o, fs);
+					ensure(fs.size() == 3);
+					ensure(fs[1].view() == "a\nb");
+				}
+			}
+			ensure(n == 200000);
+		}
+
+		return 1;
+	}
+#endif // _DEBUG
+
+} // namespace xll::csv
@@ -0,0 +1,240 @@
+// xll_datetime.h - ISO 8601 date times, time_t, and Excel dates without libc time calls
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <type_traits>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define XLL_DATETIME_SSE2
+#endif
+#include "xll24/include/ensure.h"
+
+namespace xll::datetime {
+
+	// Excel date of 1970-01-01.
+	inline constexpr double excel_epoch = 25569;
+	inline constexpr int64_t seconds_per_day = 86400;
+
+	// Days since 1970-01-01 of the proleptic Gregorian date y-m-d.
+	// http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+	constexpr int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+	{
+		y -= m <= 2;
+		const int64_t era = (y >= 0 ? y : y - 399) / 400;
+		const unsigned yoe = static_cast<unsigned>(y - era * 400);
+		const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+		const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+		return era * 146097 + static_cast<int64_t>(doe) - 719468;
+	}
+
+	// Inverse of days_from_civil.
+	constexpr void civil_from_days(int64_t z, int64_t& y, unsigned& m, unsigned& d)
+	{
+		z += 719468;
+		const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+		const unsigned doe = static_cast<unsigned>(z - era * 146097);
+		const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+		const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+		const unsigned mp = (5 * doy + 2) / 153;
+		d = doy - (153 * mp + 2) / 5 + 1;
+		m = mp < 10 ? mp + 3 : mp - 9;
+		y = static_cast<int64_t>(yoe) + era * 400 + (m <= 2);
+	}
+
+	constexpr unsigned days_in_month(int64_t y, unsigned m)
+	{
+		constexpr unsigned dim[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+		const bool leap = y % 4 == 0 && (y % 100 != 0 || y % 400 == 0);
+
+		return m == 2 && leap ? 29 : dim[m - 1];
+	}
+
+	// Excel date of t. to_time_t(to_excel(t)) == t.
+	constexpr double to_excel(time_t t)
+	{
+		return excel_epoch + static_cast<double>(t) / seconds_per_day;
+	}
+	// Nearest time_t to Excel date x.
+	inline time_t to_time_t(double x)
+	{
+		return static_cast<time_t>(std::llround((x - excel_epoch) * seconds_per_day));
+	}
+
+	namespace detail {
+
+		// Bit i is set if s[i] is a digit for the first 16 characters of s.
+		template<class C>
+		inline unsigned digit_mask16(const C* s)
+		{
+#ifdef XLL_DATETIME_SSE2
+			__m128i x;
+			if constexpr (sizeof(C) == 1) {
+				x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+			}
+			else {
+				static_assert(sizeof(C) == 2);
+				// characters above 0xFF saturate to 0xFF which is not a digit
+				x = _mm_packus_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s)),
+					_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 8)));
+			}
+			const __m128i d = _mm_sub_epi8(x, _mm_set1_epi8('0'));
+			const __m128i le9 = _mm_cmpeq_epi8(_mm_max_epu8(d, _mm_set1_epi8(9)), _mm_set1_epi8(9));
+
+			return static_cast<unsigned>(_mm_movemask_epi8(le9));
+#else
+			unsigned mask = 0;
+			for (unsigned i = 0; i < 16; ++i) {
+				mask |= static_cast<unsigned>('0' <= s[i] && s[i] <= '9') << i;
+			}
+
+			return mask;
+#endif
+		}
+
+		template<class C>
+		constexpr unsigned d2(const C* s)
+		{
+			return 10 * (s[0] - '0') + (s[1] - '0');
+		}
+
+		// Days of the last date parsed on this thread.
+		template<class C>
+		struct last_day {
+			C ymd[10] = {};
+			int64_t days = 0;
+		};
+
+	} // namespace detail
+
+	// Parse YYYY-MM-DD, YYYY-MM-DD[ T]hh:mm, or YYYY-MM-DD[ T]hh:mm:ss[.fff][Z] as UTC.
+	// Dates may also use / as the separator. Digits are checked 16 at a time
+	// and consecutive dates on the same day reuse the day computed for the previous one.
+	// Return false if s is not in one of these layouts.
+	template<class C>
+		requires (sizeof(C) == 1 || sizeof(C) == 2)
+	inline bool parse(const C* s, size_t n, time_t& t, double* fraction = nullptr)
+	{
+		static constexpr unsigned ymd_digits = 0b0000001101101111; // YYYY-MM-DD
+		static constexpr unsigned hm_digits = 0b1101100000000000; // ...hh:mm
+		const bool has_time = n >= 16;
+
+		if (n < 10 || (n > 10 && n < 16)) {
+			return false;
+		}
+		const C sep = s[4];
+		if ((sep != '-' && sep != '/') || s[7] != sep) {
+			return false;
+		}
+
+		if (has_time) {
+			if ((s[10] != ' ' && s[10] != 'T') || s[13] != ':') {
+				return false;
+			}
+			if ((detail::digit_mask16(s) & (ymd_digits | hm_digits)) != (ymd_digits | hm_digits)) {
+				return false;
+			}
+		}
+		else {
+			for (unsigned i : { 0, 1, 2, 3, 5, 6, 8, 9 }) {
+				if (s[i] < '0' || s[i] > '9') {
+					return false;
+				}
+			}
+		}
+
+		int64_t days;
+		thread_local detail::last_day<C> last;
+		if (0 == std::memcmp(s, last.ymd, sizeof(last.ymd))) {
+			days = last.days;
+		}
+		else {
+			const int64_t y = 1000 * (s[0] - '0') + 100 * (s[1] - '0') + detail::d2(s + 2);
+			const unsigned m = detail::d2(s + 5);
+			const unsigned d = detail::d2(s + 8);
+			if (m < 1 || m > 12 || d < 1 || d > days_in_month(y, m)) {
+				return false;
+			}
+			days = days_from_civil(y, m, d);
+			std::memcpy(last.ymd, s, sizeof(last.ymd));
+			last.days = days;
+		}
+
+		int64_t secs = 0;
+		double frac = 0;
+		if (has_time) {
+			const unsigned hh = detail::d2(s + 11);
+			const unsigned mm = detail::d2(s + 14);
+			unsigned ss = 0;
+			size_t i = 16;
+			if (i < n && s[i] == ':') {
+				if (n < 19 || s[17] < '0' || s[17] > '9' || s[18] < '0' || s[18] > '9') {
+					return false;
+				}
+				ss = detail::d2(s + 17);
+				i = 19;
+				if (i < n && s[i] == '.') {
+					double scale = 0.1;
+					for (++i; i < n && '0' <= s[i] && s[i] <= '9'; ++i, scale /= 10) {
+						frac += scale * (s[i] - '0');
+					}
+				}
+			}
+			if (i < n && s[i] == 'Z') {
+				++i;
+			}
+			if (i != n || hh > 23 || mm > 59 || ss > 59) {
+				return false;
+			}
+			secs = 3600 * hh + 60 * mm + ss;
+		}
+
+		t = static_cast<time_t>(days * seconds_per_day + secs);
+		if (fraction) {
+			*fraction = frac;
+		}
+
+		return true;
+	}
+
+#ifdef _DEBUG
+	inline int test_datetime()
+	{
+		for (int64_t z = -800000; z <= 800000; z += 7) {
+			int64_t y;
+			unsigned m, d;
+			civil_from_days(z, y, m, d);
+			ensure(days_from_civil(y, m, d) == z);
+		}
+		static_assert(days_from_civil(1970, 1, 1) == 0);
+		static_assert(days_from_civil(2000, 3, 1) == 11017);
+
+		for (time_t t = -2203891200; t < 4851705600; t += 999983) {
+			ensure(to_time_t(to_excel(t)) == t);
+		}
+		ensure(to_excel(0) == excel_epoch);
+
+		time_t t;
+		double f;
+		ensure(parse("1970-01-01", 10, t) && t == 0);
+		ensure(parse("2000-03-01 12:34:56", 19, t) && t == 951914096);
+		ensure(parse("2000-03-01T12:34:56.25Z", 23, t, &f) && t == 951914096 && f == 0.25);
+		ensure(parse(u"2024/02/29 23:59:59", 19, t) && t == 1709251199);
+		ensure(parse(u"2024-02-29 23:59", 16, t) && t == 1709251140);
+		ensure(parse("1969-12-31 23:59:59", 19, t) && t == -1);
+		ensure(parse("2123-09-30", 10, t) && t == 4851705600);
+		ensure(!parse("2023-02-29", 10, t));
+		ensure(!parse("2024-13-01", 10, t));
+		ensure(!parse("2024-01-01 24:00:00", 19, t));
+		ensure(!parse("2024-01-01 12:3a:00", 19, t));
+		ensure(!parse("2024-1-1", 8, t));
+		ensure(!parse("2024-01-01x", 11, t));
+		ensure(!parse(u"2024-01-01 1\x0130:00:00", 20, t));
+
+		return 1;
+	}
+#endif // _DEBUG
+
+} // namespace xll::datetime
@@ -1,9 +1,15 @@
 // xll_mem_oper.h - in memory OPER
 #pragma once
+#include <algorithm>
+#include <memory>
+#include <mutex>
 #include <span>
+#include <unordered_map>
+#include <vector>
 #include "win_mem_view.h"
 #include "xll24/include/XLCALL.h"
 #include "xll24/include/ensure.h"
+#include "xll_utf.h"
 
 namespace xll::mem {
 
@@ -25,10 +31,142 @@ namespace xll::mem {
 		using xcol = COL;
 	};
 
+	// Backing store for XOPER arrays and strings.
+	template<class X, class T = typename traits<X>::xchar>
+	struct arena {
+		Win::mem_view<X> xloper;
+		Win::mem_view<T> str;
+
+		arena() = default;
+		// Reserve room for exactly n xlopers and m characters.
+		arena(size_t n, size_t m)
+			: xloper(n), str(m)
+		{ }
+
+		void reset()
+		{
+			xloper.reset();
+			str.reset();
+		}
+		// Decommit all but about n bytes.
+		void shrink(size_t n = 0)
+		{
+			xloper.shrink(n / sizeof(X));
+			str.shrink(n / sizeof(T));
+		}
+	};
+
+	// Arenas handed out one per result and returned by xlAutoFree12.
+	// The first XLOPER in an arena is the result returned to Excel.
+	template<class X, class T = typename traits<X>::xchar>
+	class pool {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<arena<X, T>>> free;
+		std::unordered_map<const X*, std::unique_ptr<arena<X, T>>> used;
+	public:
+		// Maximum number of idle arenas kept.
+		static constexpr size_t max_free = 16;
+		// Committed bytes an idle arena keeps.
+		static constexpr size_t keep_bytes = 1 << 20;
+
+		static pool& instance()
+		{
+			static pool p;
+
+			return p;
+		}
+
+		// Arena with a nil result at the front.
+		arena<X, T>* acquire()
+		{
+			std::unique_ptr<arena<X, T>> a;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!free.empty()) {
+					a = std::move(free.back());
+					free.pop_back();
+				}
+			}
+			if (!a) {
+				a = std::make_unique<arena<X, T>>();
+			}
+
+			a->reset();
+			a->xloper.append(X{ .xltype = xltypeNil });
+
+			auto pa = a.get();
+			std::lock_guard<std::mutex> lock(mutex);
+			used.emplace(a->xloper.buf, std::move(a));
+
+			return pa;
+		}
+
+		// Return the arena whose result is px. False if px is not from the pool.
+		bool release(const X* px)
+		{
+			std::unique_ptr<arena<X, T>> a;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				auto i = used.find(px);
+				if (i == used.end()) {
+					return false;
+				}
+				a = std::move(i->second);
+				used.erase(i);
+			}
+
+			a->reset();
+			a->shrink(keep_bytes);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (free.size() < max_free) {
+				free.push_back(std::move(a));
+			}
+
+			return true;
+		}
+
+		// Number of results Excel has not freed.
+		size_t in_use()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			return used.size();
+		}
+	};
+
+	// Number of xlopers and characters needed to copy x.
+	template<class X>
+	inline std::pair<size_t, size_t> count(const X& x)
+	{
+		std::pair<size_t, size_t> n{ 1, 0 };
+
+		if (x.xltype == xltypeStr) {
+			n.second += 1 + x.val.str[0];
+		}
+		else if (x.xltype == xltypeMulti) {
+			for (size_t i = 0; i < (size_t)x.val.array.rows * x.val.array.columns; ++i) {
+				auto [a, b] = count(x.val.array.lparray[i]);
+				n.first += a;
+				n.second += b;
+			}
+		}
+
+		return n;
+	}
+
 	template<class X, class T = typename traits<X>::xchar>
 	class XOPER : public X {
-		static inline Win::mem_view<X> xloper;
-		static inline Win::mem_view<T> str;
+		// Arena used by the current thread.
+		static inline thread_local arena<X, T>* current = nullptr;
+		static arena<X, T>& heap()
+		{
+			static thread_local arena<X, T> local;
+
+			return current ? *current : local;
+		}
+		template<class X_> friend class result;
+		template<class X_> friend class scope;
 	public:
 		using X::val;
 		using X::xltype;
@@ -37,10 +175,10 @@ namespace xll::mem {
 		using xcol = typename traits<X>::xcol;
 		using xchar = typename traits<X>::xchar;
 
-		void reset(DWORD len = 0)
+		void reset(size_t len = 0)
 		{
-			xloper.reset(len);
-			str.reset(len);
+			heap().xloper.reset(len);
+			heap().str.reset(len);
 			xltype = xltypeNil;
 		}
 
@@ -143,10 +281,10 @@ namespace xll::mem {
 		}
 		// Str
 		XOPER(const xchar* _str, xchar _len)
-			: X{ .val = {.str = str.end()}, .xltype = xltypeStr }
+			: X{ .val = {.str = heap().str.end()}, .xltype = xltypeStr }
 		{
-			str.append(_len);
-			str.append(_str, _len);
+			heap().str.append(_len);
+			heap().str.append(_str, _len);
 		}
 		// counted Str
 		explicit XOPER(const xchar* _str)
@@ -171,10 +309,11 @@ namespace xll::mem {
 		{ }
 		// Multi
 		XOPER(xrw r, xcol c)
-			: X{ .val = {.array = {.lparray = xloper.end(), .rows = r, .columns = c}}, .xltype = xltypeMulti }
+			: X{ .val = {.array = {.lparray = heap().xloper.end(), .rows = r, .columns = c}}, .xltype = xltypeMulti }
 		{
+			heap().xloper.reserve(heap().xloper.len + r * c);
 			for (int i = 0; i < r * c; ++i) {
-				xloper.append(XOPER<X>{});
+				heap().xloper.append(XOPER<X>{});
 			}
 		}
 		XOPER(xrw r, xcol c, const X* pa)
@@ -186,29 +325,136 @@ namespace xll::mem {
 			}
 		}
 
+		// Append a string converted from UTF-8 straight into the arena.
+		XOPER& push_back_utf8(const char* s, size_t n)
+		{
+			static constexpr size_t max_len = sizeof(xchar) == 1 ? 0xFF : 0x7FFF;
+
+			auto& str = heap().str;
+			str.reserve(str.len + 1 + n);
+			xchar* p = str.end();
+			size_t len;
+			if constexpr (sizeof(xchar) == 1) {
+				len = std::min(n, max_len);
+				std::copy(s, s + len, p + 1);
+			}
+			else {
+				len = std::min(utf::to_utf16(s, n, p + 1), max_len);
+			}
+			p[0] = static_cast<xchar>(len);
+			str.len += 1 + len;
+
+			X x{ .val = {.str = p}, .xltype = xltypeStr };
+			if (xltype == xltypeNil) {
+				*this = XOPER<X>(1, 1);
+				val.array.lparray[0] = x;
+
+				return *this;
+			}
+
+			return append(x);
+		}
+
 		XOPER& push_back(const X& x)
 		{
 			if (xltype == xltypeNil) {
 				*this = XOPER<X>(1,1,&x);
 			}
 			else {
-				ensure(xltype == xltypeMulti);
-				xloper.append(XOPER<X>(x));
+				append(XOPER<X>(x));
+			}
 
-				if (val.array.rows == 1) {
-					++val.array.columns;
-				}
-				else if (val.array.columns == 1) {
-					++val.array.rows;
-				}
-				else {
-					ensure(__FUNCTION__ ": not a vector");
-				}
+			return *this;
+		}
+	private:
+		// Grow a vector by x without copying its string.
+		XOPER& append(const X& x)
+		{
+			ensure(xltype == xltypeMulti);
+			heap().xloper.append(x);
+
+			if (val.array.rows == 1) {
+				++val.array.columns;
+			}
+			else if (val.array.columns == 1) {
+				++val.array.rows;
+			}
+			else {
+				ensure(__FUNCTION__ ": not a vector");
 			}
 
 			return *this;
 		}
 	};
+	// Result built in its own arena from the pool.
+	// Excel calls xlAutoFree12 on the pointer returned by release.
+	template<class X>
+	class result {
+		arena<X>* a;
+		arena<X>* prev;
+	public:
+		result()
+			: a(pool<X>::instance().acquire()), prev(std::exchange(XOPER<X>::current, a))
+		{ }
+		result(const result&) = delete;
+		result& operator=(const result&) = delete;
+		~result()
+		{
+			XOPER<X>::current = prev;
+			if (a) {
+				pool<X>::instance().release(a->xloper.buf);
+			}
+		}
+
+		XOPER<X>& operator*()
+		{
+			return *reinterpret_cast<XOPER<X>*>(a->xloper.buf);
+		}
+		XOPER<X>* operator->()
+		{
+			return reinterpret_cast<XOPER<X>*>(a->xloper.buf);
+		}
+
+		// Hand ownership to Excel.
+		X* release()
+		{
+			X* px = std::exchange(a, nullptr)->xloper.buf;
+			px->xltype |= xlbitDLLFree;
+
+			return px;
+		}
+	};
+
+	// Allocate XOPERs from arena a on this thread while in scope.
+	template<class X>
+	class scope {
+		arena<X>* prev;
+	public:
+		explicit scope(arena<X>* a)
+			: prev(std::exchange(XOPER<X>::current, a))
+		{ }
+		scope(const scope&) = delete;
+		scope& operator=(const scope&) = delete;
+		~scope()
+		{
+			XOPER<X>::current = prev;
+		}
+	};
+
+	// Deep copy of x in its own exactly sized arena. The copy is the first xloper.
+	template<class X>
+	inline std::unique_ptr<arena<X>> clone(const X& x)
+	{
+		auto [n, m] = count(x);
+		auto a = std::make_unique<arena<X>>(n, m);
+		scope<X> s(a.get());
+
+		a->xloper.append(X{ .xltype = xltypeNil });
+		*reinterpret_cast<XOPER<X>*>(a->xloper.buf) = XOPER<X>(x);
+
+		return a;
+	}
+
 	using OPER12 = XOPER<XLOPER12>;
 	using OPER4 = XOPER<XLOPER>;
 	using OPER = XOPER<XLOPER12>;
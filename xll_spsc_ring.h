@@ -0,0 +1,105 @@
+// xll_spsc_ring.h - bounded lock-free queue for one producer and one consumer
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace xll {
+
+	// Fixed size ring buffer. Only one thread may push and only one thread may pop.
+	template<class T>
+	class spsc_ring {
+		std::unique_ptr<T[]> buf;
+		size_t mask;
+		// on separate cache lines so producer and consumer do not share one
+		alignas(64) std::atomic<size_t> head = 0; // next slot to pop, written by the consumer
+		alignas(64) std::atomic<size_t> tail = 0; // next slot to push, written by the producer
+	public:
+		// Capacity is n rounded up to a power of 2.
+		explicit spsc_ring(size_t n)
+		{
+			size_t cap = 1;
+			while (cap < n) {
+				cap <<= 1;
+			}
+			buf = std::make_unique<T[]>(cap);
+			mask = cap - 1;
+		}
+		spsc_ring(const spsc_ring&) = delete;
+		spsc_ring& operator=(const spsc_ring&) = delete;
+
+		size_t capacity() const
+		{
+			return mask + 1;
+		}
+
+		// Move t into the ring. Return false if the ring is full.
+		bool try_push(T& t)
+		{
+			const size_t t_ = tail.load(std::memory_order_relaxed);
+			if (t_ - head.load(std::memory_order_acquire) > mask) {
+				return false;
+			}
+			buf[t_ & mask] = std::move(t);
+			tail.store(t_ + 1, std::memory_order_release);
+
+			return true;
+		}
+
+		// Move the oldest item into t. Return false if the ring is empty.
+		bool try_pop(T& t)
+		{
+			const size_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire)) {
+				return false;
+			}
+			t = std::move(buf[h & mask]);
+			head.store(h + 1, std::memory_order_release);
+
+			return true;
+		}
+	};
+
+	// Set stop when leaving scope so threads pushing to rings quit before they are joined,
+	// even if the thread popping them throws. Declare it after the threads.
+	class stop_on_exit {
+		std::atomic<bool>& stop;
+	public:
+		explicit stop_on_exit(std::atomic<bool>& stop)
+			: stop(stop)
+		{ }
+		stop_on_exit(const stop_on_exit&) = delete;
+		stop_on_exit& operator=(const stop_on_exit&) = delete;
+		~stop_on_exit()
+		{
+			stop = true;
+		}
+	};
+
+#ifdef _DEBUG
+	inline int test_spsc_ring()
+	{
+		spsc_ring<int> r(3);
+		if (r.capacity() != 4) {
+			return FALSE;
+		}
+
+		int i = 0;
+		while (r.try_push(i)) {
+			++i;
+		}
+		if (i != 4) {
+			return FALSE;
+		}
+		for (int j = 0; j < 4; ++j) {
+			if (!r.try_pop(i) || i != j) {
+				return FALSE;
+			}
+		}
+
+		return !r.try_pop(i);
+	}
+#endif // _DEBUG
+
+} // namespace xll
@@ -3,11 +3,19 @@
 #pragma warning(disable : 5103)
 #pragma warning(disable : 5105)
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <charconv>
+#include <chrono>
+#include <exception>
 #include <iterator>
 #include <numeric>
+#include <random>
+#include <thread>
 #include "fms_sqlite/fms_sqlite.h"
+#include "xll_datetime.h"
 #include "xll_mem_oper.h"
+#include "xll_spsc_ring.h"
 //#include "xll24/splitpath.h"
 #include "xll24/include/xll.h"
 #include "xll_text.h"
@@ -57,7 +65,7 @@ namespace xll {
 	// time_t to Excel Julian date
 	inline double to_excel(time_t t)
 	{
-		return static_cast<double>(25569. + t / 86400.);
+		return datetime::to_excel(t);
 	}
 	// Gregorian to Excel
 	inline double to_excel(double d)
@@ -78,6 +86,21 @@ namespace xll {
 		return std::wstring_view(o.val.str + 1, o.val.str[0]);
 	}
 
+	// Column name in double quotes with embedded quotes doubled.
+	inline std::string quote_name(std::string_view name)
+	{
+		std::string q = "\"";
+		for (char c : name) {
+			if (c == '"') {
+				q.push_back('"');
+			}
+			q.push_back(c);
+		}
+		q.push_back('"');
+
+		return q;
+	}
+
 	// heuristic to detect Excel date type
 	// if number in [1970, 3000] then possible date
 	inline bool possibly_num_date(const OPER& x)
@@ -90,23 +113,52 @@ namespace xll {
 		return isNum(x) and _1970 <= x.val.num and x.val.num <= _2123;
 	}
 
-	inline bool is_str_date(const OPER& x, tm* ptm)
+	// Cheap check for yyyy-... or yyyy/... before calling parse_tm.
+	inline bool possibly_str_date(const OPER& x)
+	{
+		if (!isStr(x) || x.val.str[0] < 8) {
+			return false;
+		}
+
+		const auto s = x.val.str + 1;
+		const auto digit = [](auto c) { return '0' <= c && c <= '9'; };
+
+		return digit(s[0]) && digit(s[1]) && digit(s[2]) && digit(s[3]) && (s[4] == '-' || s[4] == '/');
+	}
+
+	// Parse a date string as UTC. Fixed width ISO 8601 is parsed directly and
+	// other layouts parse_tm accepts fall back to _mkgmtime.
+	template<class C>
+	inline bool parse_time_t(const C* s, size_t n, time_t* pt, double* fraction = nullptr)
 	{
-		if (!isStr(x)) {
+		if (datetime::parse(s, n, *pt, fraction)) {
+			return true;
+		}
+
+		struct tm tm;
+		if (!fms::parse_tm(fms::view(s, static_cast<int>(n)), &tm)) {
 			return false;
 		}
+		*pt = _mkgmtime(&tm);
+		if (fraction) {
+			*fraction = 0;
+		}
 
-		auto vdt = fms::view(x.val.str+1,x.val.str[0]);
-		if (vdt.len < 8) {
+		return true;
+	}
+
+	inline bool is_str_date(const OPER& x, time_t* pt)
+	{
+		if (!possibly_str_date(x)) {
 			return false;
 		}
 
-		return fms::parse_tm(vdt, ptm);
+		return parse_time_t(x.val.str + 1, x.val.str[0], pt);
 	}
 #ifdef _DEBUG
 	inline int test_is_str_date() {
 		try {
-			tm tm;
+			time_t tm;
 			ensure(is_str_date(OPER("1970-1-1"), &tm));
 			ensure(is_str_date(OPER("1970/1/1"), &tm));
 			ensure(!is_str_date(OPER("1970-1/1"), &tm));
@@ -119,6 +171,8 @@ namespace xll {
 			ensure(is_str_date(OPER("1970-1-1 00:00:00.000000000"), &tm));
 			ensure(is_str_date(OPER("1970-1-1 00:00:00.0"), &tm));
 			ensure(!is_str_date(OPER("1-1-1"), &tm));
+			ensure(is_str_date(OPER("2024-02-29 23:59:59"), &tm) && tm == 1709251199);
+			ensure(is_str_date(OPER("2024-2-29 23:59:59"), &tm) && tm == 1709251199);
 		}
 		catch (const std::exception& ex) {
 			XLL_ERROR(ex.what());
@@ -139,7 +193,7 @@ namespace xll {
 			if (possibly_num_date(x)) {
 				return SQLITE_DATETIME;
 			}
-			else if (x.val.num == std::floor(x.val.num) && std::fabs(x.val.num) < std::pow(2.,31)) {
+			else if (x.val.num == std::floor(x.val.num) && std::fabs(x.val.num) < 2147483648.) {
 				return SQLITE_INTEGER;
 			}
 			else {
@@ -153,11 +207,15 @@ namespace xll {
 			if (x.val.str[0] == 0) {
 				return SQLITE_NULL;
 			}
-			if (x.val.str[0] == 1 && strchr("YyNnTtFf", x.val.str[1])) {
-				return SQLITE_BOOLEAN;
+			if (x.val.str[0] == 1) {
+				switch (x.val.str[1]) {
+				case 'Y': case 'y': case 'N': case 'n':
+				case 'T': case 't': case 'F': case 'f':
+					return SQLITE_BOOLEAN;
+				}
 			}
-			struct tm tm;
-			if (is_str_date(x, &tm)) {
+			time_t t;
+			if (is_str_date(x, &t)) {
 				return SQLITE_DATETIME;
 			}
 			else {
@@ -193,41 +251,174 @@ namespace xll {
 		return TRUE;
 	}
 #endif // _DEBUG
+
+	// Lattice of types seen in a column. More than one type resolves to
+	// the first of text, float, integer, and boolean present.
+	class type_lattice {
+		static constexpr int types[] = {
+			SQLITE_TEXT, SQLITE_FLOAT, SQLITE_INTEGER, SQLITE_BOOLEAN, SQLITE_DATETIME, SQLITE_BLOB,
+		};
+		unsigned mask = 0;
+		static constexpr unsigned bit(int type)
+		{
+			for (unsigned i = 0; i < std::size(types); ++i) {
+				if (types[i] == type) {
+					return 1u << i;
+				}
+			}
+
+			return 0;
+		}
+	public:
+		size_t count[std::size(types)] = {}; // non-null cells of each type
+
+		void add(int type)
+		{
+			const unsigned b = bit(type);
+			if (b) {
+				mask |= b;
+				++count[std::countr_zero(b)];
+			}
+		}
+		bool has(int type) const
+		{
+			return (mask & bit(type)) != 0;
+		}
+		// Non-null cells seen.
+		size_t cells() const
+		{
+			return std::accumulate(std::begin(count), std::end(count), size_t(0));
+		}
+		// Cells seen having the resolved type.
+		size_t matches() const
+		{
+			const unsigned b = bit(type());
+
+			return b ? count[std::countr_zero(b)] : 0;
+		}
+		int type() const
+		{
+			if (mask == 0) {
+				return SQLITE_NULL;
+			}
+			if (std::popcount(mask) == 1) {
+				return types[std::countr_zero(mask)];
+			}
+			for (int t : { SQLITE_TEXT, SQLITE_FLOAT, SQLITE_INTEGER, SQLITE_BOOLEAN }) {
+				if (has(t)) {
+					return t;
+				}
+			}
+
+			return std::min(SQLITE_DATETIME, SQLITE_BLOB); // only dates and blobs
+		}
+	};
+
+	// Rows of x after off to examine. If sample is not zero and there are more
+	// than 2 sample rows then use the first sample rows and sample rows chosen at random.
+	inline std::vector<unsigned> sample_rows(unsigned rows, unsigned off, unsigned sample)
+	{
+		std::vector<unsigned> is;
+		const unsigned n = rows > off ? rows - off : 0;
+		if (sample == 0 || n <= 2 * sample) {
+			is.resize(n);
+			std::iota(is.begin(), is.end(), off);
+		}
+		else {
+			is.resize(sample);
+			std::iota(is.begin(), is.end(), off);
+			// fixed seed so recalculation gives the same types
+			std::mt19937 gen(rows);
+			std::vector<unsigned> rest(n - sample);
+			std::iota(rest.begin(), rest.end(), off + sample);
+			std::sample(rest.begin(), rest.end(), std::back_inserter(is), sample, gen);
+		}
+
+		return is;
+	}
+
+	// Infer the type of every column of x after row off in one row-major pass.
+	// Strings are not parsed as dates once a column has text since text wins.
+	inline std::vector<type_lattice> infer_sqltypes(const OPER& x, unsigned off = 0, unsigned sample = 0)
+	{
+		const unsigned c = columns(x);
+		std::vector<type_lattice> ts(c);
+
+		for (unsigned i : sample_rows(rows(x), off, sample)) {
+			for (unsigned j = 0; j < c; ++j) {
+				const OPER& xij = x(i, j);
+				auto& tj = ts[j];
+				if (isStr(xij) && tj.has(SQLITE_TEXT)) {
+					if (xij.val.str[0] != 0) {
+						tj.add(SQLITE_TEXT);
+					}
+				}
+				else {
+					auto t = guess_one_sqltype(xij);
+					ensure(t != SQLITE_UNKNOWN);
+					if (t != SQLITE_NULL) {
+						tj.add(t);
+					}
+				}
+			}
+		}
+
+		return ts;
+	}
+#ifdef _DEBUG
+	inline int test_infer_sqltypes()
+	{
+		try {
+			OPER x({
+				OPER("a"), OPER(1.), OPER(true), OPER("1970-1-1"), OPER(1.5),
+				OPER("b"), OPER(2.), OPER(OPER()), OPER("1970-1-2"), OPER(2.),
+				OPER(1.), OPER(3.), OPER("Y"), OPER("1970-1-3"), OPER(3.),
+			});
+			x.resize(3, 5);
+			auto ts = infer_sqltypes(x);
+			ensure(ts.size() == 5);
+			ensure(ts[0].type() == SQLITE_TEXT);
+			ensure(ts[0].cells() == 3);
+			ensure(ts[0].matches() == 2);
+			ensure(ts[1].type() == SQLITE_INTEGER);
+			ensure(ts[2].type() == SQLITE_BOOLEAN);
+			ensure(ts[2].cells() == 2);
+			ensure(ts[3].type() == SQLITE_DATETIME);
+			ensure(ts[4].type() == SQLITE_FLOAT);
+
+			ensure(infer_sqltypes(x, 1)[0].type() == SQLITE_TEXT);
+			ensure(sample_rows(100, 1, 10).size() == 20);
+			ensure(sample_rows(100, 1, 0).size() == 99);
+			ensure(sample_rows(10, 0, 10).size() == 10);
+		}
+		catch (const std::exception& ex) {
+			XLL_ERROR(ex.what());
+
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+#endif // _DEBUG
+
+	// Type of column col of x using rows from off to rows.
 	inline int guess_sqltype(const OPER& x, int col, int rows = -1, int off = 0)
 	{
 		ensure(col < columns(x));
 
-		std::set<int> types;
 		if (rows == -1) {
 			rows = xll::rows(x);
 		}
+		type_lattice t;
 		for (int i = off; i < rows; ++i) {
 			auto ti = guess_one_sqltype(x(i, col));
 			ensure(ti != SQLITE_UNKNOWN);
 			if (ti != SQLITE_NULL) {
-				types.insert(ti);
-			}
-		}
-
-		if (types.size() == 0) {
-			return SQLITE_NULL;
-		}
-		if (types.size() > 1) {
-			if (types.contains(SQLITE_TEXT)) {
-				return SQLITE_TEXT;
-			}
-			if (types.contains(SQLITE_FLOAT)) {
-				return SQLITE_FLOAT;
-			}
-			if (types.contains(SQLITE_INTEGER)) {
-				return SQLITE_INTEGER;
-			}
-			if (types.contains(SQLITE_BOOLEAN)) {
-				return SQLITE_BOOLEAN;
+				t.add(ti);
 			}
 		}
 
-		return *types.begin();
+		return t.type();
 	}
 
 	// 1-based
@@ -248,25 +439,170 @@ namespace xll {
 		return i;
 	}
 
-	// Convert Excel type to double.
+	// Convert text to the number VALUE would return without calling Excel: surrounding spaces,
+	// a leading sign or enclosing parentheses for negatives, comma thousands separators
+	// in groups of three, a decimal point, an exponent, and a trailing percent.
+	// Return false for anything else, such as currency symbols.
+	template<class C>
+	inline bool parse_number(const C* s, size_t n, double& d)
+	{
+		while (n && s[0] == ' ') {
+			++s, --n;
+		}
+		while (n && s[n - 1] == ' ') {
+			--n;
+		}
+
+		bool neg = false;
+		if (n >= 2 && s[0] == '(' && s[n - 1] == ')') {
+			neg = true;
+			++s, n -= 2;
+		}
+		double scale = 1;
+		if (n && s[n - 1] == '%') {
+			scale = 0.01;
+			--n;
+		}
+		if (n && (s[0] == '-' || s[0] == '+')) {
+			if (neg && s[0] == '-') {
+				return false;
+			}
+			neg = neg || s[0] == '-';
+			++s, --n;
+		}
+		if (n == 0 || n > 64) {
+			return false;
+		}
+
+		// copy without separators
+		char buf[64];
+		size_t m = 0;
+		size_t group = 0; // digits since the last comma
+		bool comma = false;
+		bool integral = true; // before the decimal point or exponent
+		for (size_t i = 0; i < n; ++i) {
+			const C c = s[i];
+			if ('0' <= c && c <= '9') {
+				++group;
+			}
+			else if (c == ',' && integral) {
+				if (group == 0 || group > 3 || (comma && group != 3)) {
+					return false;
+				}
+				comma = true;
+				group = 0;
+				continue;
+			}
+			else if (c == '.' || c == 'e' || c == 'E' || ((c == '-' || c == '+') && m && (buf[m - 1] == 'e' || buf[m - 1] == 'E'))) {
+				if (integral && comma && group != 3) {
+					return false;
+				}
+				integral = false;
+			}
+			else {
+				return false;
+			}
+			buf[m++] = static_cast<char>(c);
+		}
+		if (integral && comma && group != 3) {
+			return false;
+		}
+
+		const auto [p, ec] = std::from_chars(buf, buf + m, d);
+		if (ec != std::errc{} || p != buf + m) {
+			return false;
+		}
+		d = neg ? -d * scale : d * scale;
+
+		return true;
+	}
+
+	// Number of conversions that had to call xlfValue.
+	inline std::atomic<size_t> value_fallbacks = 0;
+
+	// Convert Excel type to double. Strings VALUE accepts that parse_number
+	// does not, like currency, are converted by Excel.
 	inline double to_float(const OPER& x)
 	{
-		return isNum(x) ? asNum(x) : asNum(Excel(xlfValue, x));	
+		if (isNum(x)) {
+			return asNum(x);
+		}
+		double d;
+		if (isStr(x) && parse_number(x.val.str + 1, x.val.str[0], d)) {
+			return d;
+		}
+		++value_fallbacks;
+
+		return asNum(Excel(xlfValue, x));
 	}
 
 	// Convert Excel type to SQLite type.
 	inline long to_int(const OPER& x)
 	{
-		return static_cast<long>(isInt(x) ? asNum(x) : asNum(Excel(xlfValue, x)));
+		return static_cast<long>(isInt(x) ? asNum(x) : to_float(x));
 	}
 
+#ifdef _DEBUG
+	inline int test_parse_number()
+	{
+		try {
+			const auto num = [](const char* s) {
+				double d;
+				ensure(parse_number(s, strlen(s), d) || !"parse_number: failed");
+
+				return d;
+			};
+			const auto not_num = [](const char* s) {
+				double d;
+
+				return !parse_number(s, strlen(s), d);
+			};
+			ensure(num("0") == 0);
+			ensure(num(" 12 ") == 12);
+			ensure(num("-1.5") == -1.5);
+			ensure(num("+1e3") == 1000);
+			ensure(num("1.5E-2") == 0.015);
+			ensure(num("1,234,567.25") == 1234567.25);
+			ensure(num("(1,000)") == -1000);
+			ensure(num("50%") == 0.5);
+			ensure(num("-12.5%") == -0.125);
+			ensure(num(".5") == 0.5);
+			ensure(not_num(""));
+			ensure(not_num(" "));
+			ensure(not_num("1,23"));
+			ensure(not_num("1234,567"));
+			ensure(not_num(",123"));
+			ensure(not_num("$12"));
+			ensure(not_num("12abc"));
+			ensure(not_num("(-1)"));
+			ensure(not_num("1-2"));
+			double d;
+			ensure(parse_number(L"1,000.5", 7, d) && d == 1000.5);
+			ensure(!parse_number(L"1\x0660", 2, d)); // Arabic-Indic zero
+		}
+		catch (const std::exception& ex) {
+			XLL_ERROR(ex.what());
+
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+#endif // _DEBUG
+
 	inline bool is_null(const OPER& x)
 	{
 		return isMissing(x) || isNil(x) || isErr(x);
 	}
 
+	// How text cells are bound.
+	enum class text_binding {
+		copy, // UTF-8 converted in a scratch buffer and copied by sqlite
+		in_place, // UTF-16 of the cell without copying. The cell must outlive the step.
+	};
+
 	// Bind OPER to 1-based SQLite statement column j based on sqlite extended type tj.
-	inline void bind(sqlite::stmt& stmt, int j, const OPER& x, int tj = 0)
+	inline void bind(sqlite::stmt& stmt, int j, const OPER& x, int tj = 0, text_binding tb = text_binding::copy)
 	{
 		if (is_null(x)) {
 			stmt.bind(j); // NULL
@@ -285,20 +621,19 @@ namespace xll {
 					stmt.bind(j);
 				}
 				else if (possibly_num_date(x)) {
-					stmt.bind(j, to_time_t(x.val.num));
+					stmt.bind(j, datetime::to_time_t(x.val.num));
 				}
 				else {
 					stmt.bind(j, asNum(x)); // SQLITE_FLOAT Gregorian?
 				}
 			}
 			else if (isStr(x)) {
-				auto sv = fms::view(x.val.str + 1, x.val.str[0]);
-				struct tm tm;
+				time_t t;
 				if (x == "") {
 					stmt.bind(j);
 				}
-				else if (fms::parse_tm(sv, &tm)) {
-					stmt.bind(j, _mkgmtime(&tm));
+				else if (parse_time_t(x.val.str + 1, x.val.str[0], &t)) {
+					stmt.bind(j, t);
 				}
 				else {
 					ensure (!__FUNCTION__ ": invalid date string: ");
@@ -312,8 +647,8 @@ namespace xll {
 			bool b;
 			if (isStr(x)) {
 				ensure(x.val.str[0] == 1);
-				ensure(strchr("YyTtNnFf", x.val.str[1]));
-				b = (0 != strchr("YyTt", x.val.str[1]));
+				ensure(std::wstring_view(L"YyTtNnFf").find(x.val.str[1]) != std::wstring_view::npos);
+				b = (std::wstring_view(L"YyTt").find(x.val.str[1]) != std::wstring_view::npos);
 			}
 			else {
 				b = asNum(x) != 0;
@@ -330,7 +665,15 @@ namespace xll {
 				stmt.bind(j, (int)asNum(x));
 				break;
 			case xltypeStr:
-				stmt.bind(j, to_string(x));
+				if (tb == text_binding::in_place) {
+					FMS_SQLITE_OK(stmt.db_handle(),
+						sqlite3_bind_text16(stmt, j, x.val.str + 1, 2 * x.val.str[0], SQLITE_STATIC));
+				}
+				else {
+					const auto s = wcstombs_view(x.val.str + 1, x.val.str[0]);
+					FMS_SQLITE_OK(stmt.db_handle(),
+						sqlite3_bind_text(stmt, j, s.empty() ? "" : s.data(), static_cast<int>(s.size()), SQLITE_TRANSIENT));
+				}
 				break;
 			default:
 				ensure(!__FUNCTION__ ": invalid type");
@@ -358,6 +701,580 @@ namespace xll {
 		}
 	}
 
+	// Type used to bind each column of data starting at row off.
+	inline std::vector<int> type_plan(const OPER& data, unsigned off = 0)
+	{
+		const auto ts = infer_sqltypes(data, off);
+		std::vector<int> type(ts.size());
+		for (unsigned j = 0; j < type.size(); ++j) {
+			type[j] = ts[j].type();
+		}
+
+		return type;
+	}
+
+	// 1-based parameter index of name with or without a :, @, or $ prefix.
+	inline int parameter_index(sqlite3_stmt* stmt, const std::string& name)
+	{
+		int i = sqlite3_bind_parameter_index(stmt, name.c_str());
+		for (const char* prefix : { ":", "@", "$" }) {
+			if (i) {
+				break;
+			}
+			i = sqlite3_bind_parameter_index(stmt, (prefix + name).c_str());
+		}
+
+		return i;
+	}
+
+	// Parameter index of each column of data. If every cell in the first row names
+	// a parameter then columns are bound by name and off is set to 1, otherwise by position.
+	inline std::vector<int> parameter_plan(sqlite::stmt& stmt, const OPER& data, unsigned& off)
+	{
+		std::vector<int> index(columns(data));
+		for (unsigned j = 0; j < index.size(); ++j) {
+			const OPER& hj = data(0, j);
+			index[j] = isStr(hj) ? parameter_index(stmt, to_string(hj)) : 0;
+			if (!index[j]) {
+				std::iota(index.begin(), index.end(), 1);
+				off = 0;
+
+				return index;
+			}
+		}
+		off = 1;
+
+		return index;
+	}
+
+	// Savepoint that is rolled back unless released.
+	// Unlike BEGIN it nests inside a transaction started by the caller.
+	class savepoint {
+		sqlite3* db;
+		bool released = false;
+	public:
+		explicit savepoint(sqlite3* db)
+			: db(db)
+		{
+			FMS_SQLITE_OK(db, sqlite3_exec(db, "SAVEPOINT xll_savepoint", NULL, NULL, NULL));
+		}
+		savepoint(const savepoint&) = delete;
+		savepoint& operator=(const savepoint&) = delete;
+		~savepoint()
+		{
+			if (!released) {
+				sqlite3_exec(db, "ROLLBACK TO xll_savepoint; RELEASE xll_savepoint", NULL, NULL, NULL);
+			}
+		}
+
+		void release()
+		{
+			FMS_SQLITE_OK(db, sqlite3_exec(db, "RELEASE xll_savepoint", NULL, NULL, NULL));
+			released = true;
+		}
+	};
+
+	// Forget the rows SQL.INSERT_INTO with a key recorded for table.
+	// Called when the table is dropped or reloaded so stale rowids are never reused.
+	inline void sync_forget(sqlite3* db, const char* table)
+	{
+		sqlite::stmt stmt(db);
+		stmt.prepare("SELECT count(*) FROM sqlite_schema WHERE type = 'table' AND name IN ('xll_sync', 'xll_sync_range')");
+		if (SQLITE_ROW != sqlite3_step(stmt) || sqlite3_column_int(stmt, 0) != 2) {
+			return; // never synced
+		}
+		for (const char* sql : { "DELETE FROM xll_sync WHERE tbl = ?1", "DELETE FROM xll_sync_range WHERE tbl = ?1" }) {
+			stmt.prepare(sql);
+			sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+			const int ret = sqlite3_step(stmt);
+			FMS_SQLITE_OK(db, ret == SQLITE_DONE ? SQLITE_OK : ret);
+		}
+	}
+
+	// Bind and step each row of data after off in a single transaction.
+	// Column j is bound to parameter index[j]. Each cell is bound by its own type
+	// like SQL.BIND, so numbers are never taken for dates. Return the number of rows changed.
+	inline sqlite3_int64 executemany(sqlite::stmt& stmt, const OPER& data, unsigned off,
+		const std::vector<int>& index)
+	{
+		sqlite3* db = stmt.db_handle();
+		savepoint sp(db);
+
+		// text is bound in place so unbind it before data goes away
+		const auto unbind = [&]() {
+			stmt.reset();
+			for (int i : index) {
+				sqlite3_bind_null(stmt, i);
+			}
+		};
+
+		sqlite3_int64 changes = 0;
+		try {
+			for (unsigned i = off; i < rows(data); ++i) {
+				for (unsigned j = 0; j < index.size(); ++j) {
+					const OPER& x = data(i, j);
+					bind(stmt, index[j], x, sqltype(type(x)), text_binding::in_place);
+				}
+				int ret;
+				while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+					; // ignore rows returned
+				}
+				FMS_SQLITE_OK(db, ret == SQLITE_DONE ? SQLITE_OK : ret);
+				changes += sqlite3_changes64(db);
+				stmt.reset();
+			}
+		}
+		catch (...) {
+			unbind();
+
+			throw;
+		}
+		unbind();
+		sp.release();
+
+		return changes;
+	}
+#ifdef _DEBUG
+	inline int test_executemany()
+	{
+		try {
+			sqlite::db db("", SQLITE_OPEN_READWRITE | SQLITE_OPEN_MEMORY);
+			FMS_SQLITE_OK(db, sqlite3_exec(db, "CREATE TABLE t (id INTEGER, flag TEXT)", NULL, NULL, NULL));
+			const std::vector<int> index = { 1, 2 };
+
+			// an id in the range of Excel dates and a flag that looks like a boolean
+			OPER data({ OPER(30000.), OPER("Y") });
+			data.resize(1, 2);
+
+			sqlite::stmt stmt(db);
+			stmt.prepare("INSERT INTO t VALUES (?, ?)");
+			ensure(1 == executemany(stmt, data, 0, index));
+			stmt.prepare("UPDATE t SET flag = flag WHERE id = ? AND flag = ?");
+			ensure(1 == executemany(stmt, data, 0, index));
+
+			stmt.prepare("SELECT id, flag FROM t");
+			ensure(SQLITE_ROW == sqlite3_step(stmt));
+			ensure(30000 == sqlite3_column_int64(stmt, 0));
+			ensure(0 == strcmp("Y", (const char*)sqlite3_column_text(stmt, 1)));
+		}
+		catch (const std::exception& ex) {
+			XLL_ERROR(ex.what());
+
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+#endif // _DEBUG
+
+	// INSERT INTO table VALUES (?, ...), ... with n rows of m parameters.
+	inline std::string insert_values(const std::string& table, size_t m, size_t n)
+	{
+		std::string row = "(?";
+		for (size_t j = 1; j < m; ++j) {
+			row.append(",?");
+		}
+		row.append(")");
+
+		std::string sql = "INSERT INTO " + table + " VALUES ";
+		sql.reserve(sql.size() + n * (row.size() + 1));
+		for (size_t i = 0; i < n; ++i) {
+			if (i) {
+				sql.push_back(',');
+			}
+			sql.append(row);
+		}
+
+		return sql;
+	}
+
+	// Insert rows of data after off into a table with type.size() columns in a single transaction.
+	// Each statement inserts as many rows as fit in SQLITE_LIMIT_VARIABLE_NUMBER parameters
+	// and a tail statement inserts the remainder. Missing columns are NULL.
+	inline sqlite3_int64 insert_batch(sqlite3* db, const std::string& table, const OPER& data, unsigned off,
+		const std::vector<int>& type)
+	{
+		const size_t m = type.size();
+		const size_t n = rows(data) > off ? rows(data) - off : 0;
+		const size_t c = std::min<size_t>(columns(data), m);
+		ensure(m > 0);
+		if (n == 0) {
+			return 0;
+		}
+
+		const size_t max_vars = sqlite3_limit(db, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+		const size_t batch = std::clamp<size_t>(max_vars / m, 1, n);
+
+		// bind k rows starting at data row i and step
+		const auto insert = [&](sqlite::stmt& stmt, size_t i, size_t k) {
+			for (size_t r = 0; r < k; ++r) {
+				for (size_t j = 0; j < c; ++j) {
+					bind(stmt, static_cast<int>(r * m + j + 1), data(static_cast<unsigned>(i + r), static_cast<unsigned>(j)), type[j],
+						text_binding::in_place);
+				}
+			}
+			const int ret = sqlite3_step(stmt);
+			FMS_SQLITE_OK(db, ret == SQLITE_DONE ? SQLITE_OK : ret);
+			stmt.reset();
+		};
+
+		savepoint sp(db);
+
+		sqlite::stmt stmt(db);
+		stmt.prepare(insert_values(table, m, batch));
+		size_t i = off;
+		for (; i + batch <= off + n; i += batch) {
+			insert(stmt, i, batch);
+		}
+		if (i < off + n) {
+			sqlite::stmt tail(db);
+			tail.prepare(insert_values(table, m, off + n - i));
+			insert(tail, i, off + n - i);
+		}
+
+		sp.release();
+
+		return static_cast<sqlite3_int64>(n);
+	}
+
+	// Row block of data encoded as sqlite values off the inserting thread.
+	struct encoded_block {
+		struct value {
+			int type = SQLITE_NULL; // SQLITE_NULL, SQLITE_INTEGER, SQLITE_FLOAT, or SQLITE_TEXT
+			int len = 0; // bytes of text
+			union {
+				sqlite3_int64 i;
+				double d;
+				size_t off; // of text
+			};
+		};
+		size_t row = 0; // first row of data
+		size_t rows = 0;
+		std::vector<value> values; // row major with type.size() values per row
+		std::string text; // UTF-8 of every text value
+		std::exception_ptr error;
+	};
+
+	// Append x as the value bind would use for extended type t.
+	inline void encode(const OPER& x, int t, encoded_block& b)
+	{
+		auto& v = b.values.emplace_back();
+
+		if (is_null(x)) {
+			return;
+		}
+
+		if (t == SQLITE_DATETIME) {
+			if (isNum(x)) {
+				if (x == 0) {
+					; // NULL
+				}
+				else if (possibly_num_date(x)) {
+					v.type = SQLITE_INTEGER;
+					v.i = datetime::to_time_t(x.val.num);
+				}
+				else {
+					v.type = SQLITE_FLOAT;
+					v.d = asNum(x);
+				}
+			}
+			else if (isStr(x)) {
+				time_t t;
+				if (x == "") {
+					; // NULL
+				}
+				else if (parse_time_t(x.val.str + 1, x.val.str[0], &t)) {
+					v.type = SQLITE_INTEGER;
+					v.i = t;
+				}
+				else {
+					ensure(!__FUNCTION__ ": invalid date string: ");
+				}
+			}
+			else {
+				ensure(!__FUNCTION__ ": date must be number or string");
+			}
+		}
+		else if (t == SQLITE_BOOLEAN) {
+			v.type = SQLITE_INTEGER;
+			if (isStr(x)) {
+				ensure(x.val.str[0] == 1);
+				ensure(std::wstring_view(L"YyTtNnFf").find(x.val.str[1]) != std::wstring_view::npos);
+				v.i = (std::wstring_view(L"YyTt").find(x.val.str[1]) != std::wstring_view::npos);
+			}
+			else {
+				v.i = asNum(x) != 0;
+			}
+		}
+		else {
+			switch (type(x)) {
+			case xltypeNum:
+				v.type = SQLITE_FLOAT;
+				v.d = asNum(x);
+				break;
+			case xltypeInt:
+			case xltypeBool:
+				v.type = SQLITE_INTEGER;
+				v.i = (int)asNum(x);
+				break;
+			case xltypeStr: {
+				const auto s = wcstombs_view(x.val.str + 1, x.val.str[0]);
+				v.type = SQLITE_TEXT;
+				v.len = static_cast<int>(s.size());
+				v.off = b.text.size();
+				b.text.append(s);
+				break;
+			}
+			default:
+				ensure(!__FUNCTION__ ": invalid type");
+			}
+		}
+	}
+
+	// Encode b.rows rows of data starting at b.row. Missing columns are NULL.
+	inline void encode(const OPER& data, const std::vector<int>& type, encoded_block& b)
+	{
+		const size_t m = type.size();
+		const size_t c = std::min<size_t>(columns(data), m);
+
+		b.values.clear();
+		b.values.reserve(b.rows * m);
+		b.text.clear();
+		for (size_t r = 0; r < b.rows; ++r) {
+			for (size_t j = 0; j < c; ++j) {
+				encode(data(static_cast<unsigned>(b.row + r), static_cast<unsigned>(j)), type[j], b);
+			}
+			b.values.resize(b.values.size() + m - c);
+		}
+	}
+
+	// Bind the values of b to parameters 1, 2, .... Text is not copied so b must outlive the step.
+	inline void bind(sqlite3_stmt* stmt, const encoded_block& b)
+	{
+		sqlite3* db = sqlite3_db_handle(stmt);
+		for (int i = 0; i < static_cast<int>(b.values.size()); ++i) {
+			const auto& v = b.values[i];
+			int ret;
+			switch (v.type) {
+			case SQLITE_INTEGER:
+				ret = sqlite3_bind_int64(stmt, i + 1, v.i);
+				break;
+			case SQLITE_FLOAT:
+				ret = sqlite3_bind_double(stmt, i + 1, v.d);
+				break;
+			case SQLITE_TEXT:
+				ret = sqlite3_bind_text(stmt, i + 1, b.text.data() + v.off, v.len, SQLITE_STATIC);
+				break;
+			default:
+				ret = sqlite3_bind_null(stmt, i + 1);
+			}
+			FMS_SQLITE_OK(db, ret);
+		}
+	}
+
+	// Insert like insert_batch but convert cells on worker threads while this thread steps.
+	// Worker w encodes blocks w, w + workers, ... and hands them over its own spsc_ring
+	// so blocks are inserted in order. Small ranges fall back to insert_batch.
+	inline sqlite3_int64 insert_pipeline(sqlite3* db, const std::string& table, const OPER& data, unsigned off,
+		const std::vector<int>& type, unsigned workers = 0)
+	{
+		const size_t m = type.size();
+		const size_t n = rows(data) > off ? rows(data) - off : 0;
+		ensure(m > 0);
+
+		const size_t max_vars = sqlite3_limit(db, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+		const size_t batch = std::clamp<size_t>(max_vars / m, 1, std::max<size_t>(n, 1));
+		const size_t blocks = (n + batch - 1) / batch;
+		if (workers == 0) {
+			workers = std::clamp(std::thread::hardware_concurrency() - 1, 1u, 8u);
+		}
+		workers = static_cast<unsigned>(std::min<size_t>(workers, blocks));
+		// not worth starting threads
+		if (blocks < 2 || n * m < (1 << 14)) {
+			return insert_batch(db, table, data, off, type);
+		}
+
+		savepoint sp(db);
+
+		sqlite::stmt stmt(db), tail(db);
+		stmt.prepare(insert_values(table, m, batch));
+		if (n % batch) {
+			tail.prepare(insert_values(table, m, n % batch));
+		}
+
+		std::vector<std::unique_ptr<spsc_ring<encoded_block>>> rings(workers);
+		for (auto& ring : rings) {
+			ring = std::make_unique<spsc_ring<encoded_block>>(4);
+		}
+		std::atomic<bool> stop = false;
+		{
+			std::vector<std::jthread> producers;
+			stop_on_exit guard(stop);
+			for (unsigned w = 0; w < workers; ++w) {
+				producers.emplace_back([&, w]() {
+					for (size_t k = w; k < blocks && !stop; k += workers) {
+						encoded_block b;
+						b.row = off + k * batch;
+						b.rows = std::min(batch, off + n - b.row);
+						try {
+							encode(data, type, b);
+						}
+						catch (...) {
+							b.error = std::current_exception();
+						}
+						const bool failed = b.error != nullptr;
+						while (!rings[w]->try_push(b)) {
+							if (stop) {
+								return;
+							}
+							std::this_thread::yield();
+						}
+						if (failed) {
+							return;
+						}
+					}
+				});
+			}
+
+			encoded_block b;
+			for (size_t k = 0; k < blocks; ++k) {
+				while (!rings[k % workers]->try_pop(b)) {
+					std::this_thread::yield();
+				}
+				if (b.error) {
+					std::rethrow_exception(b.error);
+				}
+				sqlite::stmt& s = b.rows == batch ? stmt : tail;
+				bind(s, b);
+				const int ret = sqlite3_step(s);
+				FMS_SQLITE_OK(db, ret == SQLITE_DONE ? SQLITE_OK : ret);
+				s.reset();
+			}
+		}
+
+		sp.release();
+
+		return static_cast<sqlite3_int64>(n);
+	}
+
+	// Seconds spent in each phase of a bulk load.
+	struct bulk_timing {
+		enum phase { pragmas, drop_indexes, insert, create_indexes, analyze, restore, count };
+		static constexpr const char* phase_name[] = {
+			"pragmas", "drop indexes", "insert", "create indexes", "analyze", "restore",
+		};
+		double seconds[count] = {};
+		size_t rows = 0;
+		size_t indexes = 0; // indexes dropped and rebuilt
+
+		double total() const
+		{
+			return std::accumulate(std::begin(seconds), std::end(seconds), 0.);
+		}
+	};
+
+	// Value of PRAGMA name as text.
+	inline std::string pragma_value(sqlite3* db, const char* name)
+	{
+		sqlite::stmt stmt(db);
+		stmt.prepare(std::string("PRAGMA ") + name);
+		const int ret = sqlite3_step(stmt);
+		FMS_SQLITE_OK(db, ret == SQLITE_ROW || ret == SQLITE_DONE ? SQLITE_OK : ret);
+
+		const auto text = ret == SQLITE_ROW ? sqlite3_column_text(stmt, 0) : nullptr;
+
+		return text ? reinterpret_cast<const char*>(text) : "";
+	}
+
+	// Insert data into table with the journal in memory, synchronous off, a large page cache,
+	// and more sorter threads. Secondary indexes of the table are dropped before and rebuilt after.
+	// The connection settings are restored when done.
+	inline bulk_timing bulk_insert(sqlite3* db, const char* table, const OPER& data, unsigned off,
+		const std::vector<int>& type)
+	{
+		using clock = std::chrono::steady_clock;
+		bulk_timing t;
+		auto start = clock::now();
+		const auto lap = [&](bulk_timing::phase p) {
+			const auto now = clock::now();
+			t.seconds[p] = std::chrono::duration<double>(now - start).count();
+			start = now;
+		};
+		const auto exec = [db](const std::string& sql) {
+			FMS_SQLITE_OK(db, sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL));
+		};
+
+		// journal_mode can only change outside a transaction
+		const bool autocommit = sqlite3_get_autocommit(db) != 0;
+		const std::string journal_mode = autocommit ? pragma_value(db, "journal_mode") : "";
+		const std::string synchronous = pragma_value(db, "synchronous");
+		const std::string cache_size = pragma_value(db, "cache_size");
+		const std::string threads = pragma_value(db, "threads");
+		const auto restore = [&]() {
+			// best effort, the load already succeeded or failed
+			if (autocommit) {
+				sqlite3_exec(db, ("PRAGMA journal_mode = " + journal_mode).c_str(), NULL, NULL, NULL);
+			}
+			sqlite3_exec(db, ("PRAGMA synchronous = " + synchronous).c_str(), NULL, NULL, NULL);
+			sqlite3_exec(db, ("PRAGMA cache_size = " + cache_size).c_str(), NULL, NULL, NULL);
+			sqlite3_exec(db, ("PRAGMA threads = " + threads).c_str(), NULL, NULL, NULL);
+		};
+
+		// MEMORY rather than OFF so a failed load can still be rolled back
+		if (autocommit) {
+			sqlite3_exec(db, "PRAGMA journal_mode = MEMORY", NULL, NULL, NULL);
+		}
+		sqlite3_exec(db, "PRAGMA synchronous = OFF", NULL, NULL, NULL);
+		sqlite3_exec(db, "PRAGMA cache_size = -262144", NULL, NULL, NULL); // 256MB
+		sqlite3_exec(db, ("PRAGMA threads = " + std::to_string(std::thread::hardware_concurrency())).c_str(), NULL, NULL, NULL);
+		lap(bulk_timing::pragmas);
+
+		try {
+			savepoint sp(db);
+
+			// indexes created by UNIQUE and PRIMARY KEY have no sql and are kept
+			std::vector<std::pair<std::string, std::string>> indexes;
+			{
+				sqlite::stmt stmt(db);
+				stmt.prepare("SELECT name, sql FROM sqlite_schema WHERE type = 'index' AND tbl_name = ?1 AND sql IS NOT NULL");
+				sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+				while (SQLITE_ROW == sqlite3_step(stmt)) {
+					indexes.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+						reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)));
+				}
+			}
+			for (const auto& [name, sql] : indexes) {
+				exec("DROP INDEX " + sqlite::table_name(name.c_str()));
+			}
+			t.indexes = indexes.size();
+			lap(bulk_timing::drop_indexes);
+
+			t.rows = static_cast<size_t>(insert_pipeline(db, sqlite::table_name(table), data, off, type));
+			lap(bulk_timing::insert);
+
+			for (const auto& [name, sql] : indexes) {
+				exec(sql);
+			}
+			lap(bulk_timing::create_indexes);
+
+			sp.release();
+
+			exec("ANALYZE " + sqlite::table_name(table));
+			exec("PRAGMA optimize");
+			lap(bulk_timing::analyze);
+		}
+		catch (...) {
+			restore();
+
+			throw;
+		}
+
+		restore();
+		lap(bulk_timing::restore);
+
+		return t;
+	}
+
 	// Convert SQLite value to OPER.
 	inline auto as_oper(const sqlite::value& v)
 	{
@@ -406,6 +1323,139 @@ namespace xll {
 		}
 	}
 
+	// Convert column j of the current row of a statement.
+	using decoder = OPER(*)(sqlite3_stmt*, int);
+
+	// Convert by storage class like as_oper for columns without a declared type.
+	inline OPER decode_value(sqlite3_stmt* stmt, int j)
+	{
+		switch (sqlite3_column_type(stmt, j)) {
+		case SQLITE_INTEGER:
+			return OPER(static_cast<double>(sqlite3_column_int64(stmt, j)));
+		case SQLITE_FLOAT:
+			return OPER(sqlite3_column_double(stmt, j));
+		case SQLITE_TEXT:
+			return OPER(reinterpret_cast<const char*>(sqlite3_column_text(stmt, j)), sqlite3_column_bytes(stmt, j));
+		case SQLITE_NULL:
+			return OPER("");
+		default:
+			return OPER(OPER::Err::NA);
+		}
+	}
+
+	// Converter specialized on the declared extended type T of a column.
+	// Values stored with another storage class fall back to decode_value.
+	template<int T>
+	inline OPER decode(sqlite3_stmt* stmt, int j)
+	{
+		return decode_value(stmt, j);
+	}
+	template<>
+	inline OPER decode<SQLITE_INTEGER>(sqlite3_stmt* stmt, int j)
+	{
+		return sqlite3_column_type(stmt, j) == SQLITE_INTEGER
+			? OPER(static_cast<double>(sqlite3_column_int64(stmt, j))) : decode_value(stmt, j);
+	}
+	template<>
+	inline OPER decode<SQLITE_FLOAT>(sqlite3_stmt* stmt, int j)
+	{
+		const int t = sqlite3_column_type(stmt, j);
+
+		return t == SQLITE_FLOAT || t == SQLITE_INTEGER ? OPER(sqlite3_column_double(stmt, j)) : decode_value(stmt, j);
+	}
+	template<>
+	inline OPER decode<SQLITE_BOOLEAN>(sqlite3_stmt* stmt, int j)
+	{
+		return sqlite3_column_type(stmt, j) == SQLITE_INTEGER
+			? OPER(sqlite3_column_int64(stmt, j) != 0) : decode_value(stmt, j);
+	}
+	template<>
+	inline OPER decode<SQLITE_DATETIME>(sqlite3_stmt* stmt, int j)
+	{
+		switch (sqlite3_column_type(stmt, j)) {
+		case SQLITE_INTEGER:
+			return OPER(to_excel(static_cast<time_t>(sqlite3_column_int64(stmt, j))));
+		case SQLITE_FLOAT:
+			return OPER(to_excel(sqlite3_column_double(stmt, j)));
+		case SQLITE_TEXT: {
+			const auto str = reinterpret_cast<const char*>(sqlite3_column_text(stmt, j));
+			const int len = sqlite3_column_bytes(stmt, j);
+			if (len == 0) {
+				return OPER("");
+			}
+			time_t t;
+			double f;
+			if (parse_time_t(str, len, &t, &f)) {
+				return OPER(to_excel(t) + f / datetime::seconds_per_day);
+			}
+
+			return OPER(to_excel(sqlite3_column_double(stmt, j)));
+		}
+		default:
+			return decode_value(stmt, j);
+		}
+	}
+
+	// Converter for each column of a statement chosen once from its declared type
+	// instead of looking the type up for every value. Rows are still decoded one at
+	// a time since sqlite3_step only exposes the current row.
+	class decoder_plan {
+		std::vector<decoder> plan;
+		std::vector<char> text; // text values are returned as text
+	public:
+		explicit decoder_plan(sqlite3_stmt* stmt)
+			: plan(sqlite3_column_count(stmt)), text(plan.size(), true)
+		{
+			for (int j = 0; j < static_cast<int>(plan.size()); ++j) {
+				const char* decl = sqlite3_column_decltype(stmt, j);
+				switch (decl ? sqlite::sqltype(decl) : SQLITE_NULL) {
+				case SQLITE_INTEGER:
+					plan[j] = decode<SQLITE_INTEGER>;
+					break;
+				case SQLITE_FLOAT:
+					plan[j] = decode<SQLITE_FLOAT>;
+					break;
+				case SQLITE_BOOLEAN:
+					plan[j] = decode<SQLITE_BOOLEAN>;
+					break;
+				case SQLITE_DATETIME:
+					plan[j] = decode<SQLITE_DATETIME>;
+					text[j] = false;
+					break;
+				default:
+					plan[j] = decode<SQLITE_NULL>;
+				}
+			}
+		}
+
+		size_t size() const
+		{
+			return plan.size();
+		}
+		decoder operator[](size_t j) const
+		{
+			return plan[j];
+		}
+
+		// Append the current row of stmt to o.
+		// Text is transcoded straight into o when it has a string arena.
+		template<class O>
+		void row(sqlite3_stmt* stmt, O& o) const
+		{
+			for (int j = 0; j < static_cast<int>(plan.size()); ++j) {
+				if constexpr (requires { o.push_back_utf8("", 0); }) {
+					if (text[j] && sqlite3_column_type(stmt, j) == SQLITE_TEXT) {
+						const auto s = reinterpret_cast<const char*>(sqlite3_column_text(stmt, j));
+						o.push_back_utf8(s, sqlite3_column_bytes(stmt, j));
+
+						continue;
+					}
+				}
+				o.push_back(plan[j](stmt, j));
+			}
+		}
+	};
+
 	template<class O, class X = O::value_type>
 	inline auto headers(sqlite::stmt& stmt, O& o)
 	{
@@ -417,8 +1467,12 @@ namespace xll {
 	template<class O>
 	inline auto map(sqlite::stmt& stmt, O& o)
 	{
-		using X = typename O::value_type;
-		sqlite::map(stmt, std::back_inserter(o), as_oper<X>);
+		const decoder_plan plan(stmt);
+		int ret;
+		while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+			plan.row(stmt, o);
+		}
+		FMS_SQLITE_OK(stmt.db_handle(), ret == SQLITE_DONE ? SQLITE_OK : ret);
 
 		auto c = stmt.column_count();
 		if (c != 0) {
@@ -426,6 +1480,153 @@ namespace xll {
 			o.resize(o.size() / c, c);
 		}
 	}
+	// Position of a statement paged through by fetch.
+	struct cursor {
+		size_t rows = 0; // rows stepped over or fetched so far
+		bool done = false; // last step returned SQLITE_DONE
+	};
+
+	// Append at most n rows to o without resetting the statement.
+	// Rows appended before an error are kept and reshaped.
+	template<class O>
+	inline size_t fetch(sqlite::stmt& stmt, O& o, size_t n, cursor& cur)
+	{
+		size_t i = 0;
+		const int c = stmt.column_count();
+		const decoder_plan plan(stmt);
+
+		int ret = SQLITE_ROW;
+		while (i < n && !cur.done) {
+			ret = sqlite3_step(stmt);
+			if (SQLITE_ROW == ret) {
+				plan.row(stmt, o);
+				++i;
+			}
+			else {
+				cur.done = true;
+			}
+		}
+		cur.rows += i;
+
+		if (c != 0 && o.size() > 1) {
+			ensure(0 == o.size() % c);
+			o.resize(o.size() / c, c);
+		}
+
+		if (SQLITE_ROW != ret && SQLITE_DONE != ret) {
+			FMS_SQLITE_OK(stmt.db_handle(), ret);
+		}
+
+		return i;
+	}
+	// Step over at most n rows without decoding them.
+	inline size_t skip(sqlite::stmt& stmt, size_t n, cursor& cur)
+	{
+		size_t i = 0;
+
+		int ret = SQLITE_ROW;
+		while (i < n && !cur.done) {
+			ret = sqlite3_step(stmt);
+			if (SQLITE_ROW == ret) {
+				++i;
+			}
+			else {
+				cur.done = true;
+			}
+		}
+		cur.rows += i;
+
+		if (SQLITE_ROW != ret && SQLITE_DONE != ret) {
+			FMS_SQLITE_OK(stmt.db_handle(), ret);
+		}
+
+		return i;
+	}
+
+	// Statement owned by a \SQL.STMT handle.
+	// The position of SQL.FETCH is freed with the handle.
+	struct sqlite_stmt : public sqlite::stmt {
+		using sqlite::stmt::stmt;
+		cursor cur;
+	};
+
+	// Time and row limits on a statement enforced by sqlite3_progress_handler.
+	struct progress {
+		enum status_t { completed, timeout, row_limit, aborted };
+		static inline const char* status_name[] = { "completed", "timeout", "row_limit", "aborted" };
+		// Virtual machine instructions between checks.
+		static constexpr int period = 10000;
+
+		double timeout = 0;       // seconds, 0 for none
+		size_t max_rows = 0;      // 0 for none
+		bool check_abort = false; // poll xlAbort so Esc interrupts
+
+		status_t status = completed;
+		size_t rows = 0;
+		sqlite3_int64 vm_steps = 0;
+		double elapsed = 0;
+
+		std::chrono::steady_clock::time_point start, deadline;
+
+		static int handler(void* pv)
+		{
+			auto p = static_cast<progress*>(pv);
+
+			if (p->timeout > 0 && std::chrono::steady_clock::now() > p->deadline) {
+				p->status = timeout;
+
+				return 1;
+			}
+			if (p->check_abort && Excel(xlAbort) == true) {
+				p->status = aborted;
+
+				return 1;
+			}
+
+			return 0;
+		}
+	};
+
+	// Like map but stop at the limits in p. Rows read before stopping are kept.
+	template<class O>
+	inline void map(sqlite::stmt& stmt, O& o, progress& p)
+	{
+		using namespace std::chrono;
+
+		sqlite3* db = stmt.db_handle();
+		p.start = steady_clock::now();
+		p.deadline = p.start + duration_cast<steady_clock::duration>(duration<double>(p.timeout));
+		p.status = progress::completed;
+		sqlite3_progress_handler(db, progress::period, progress::handler, &p);
+
+		cursor cur;
+		try {
+			fetch(stmt, o, p.max_rows ? p.max_rows : SIZE_MAX, cur);
+			// a result with exactly max_rows rows was not truncated
+			if (!cur.done) {
+				const int ret = sqlite3_step(stmt);
+				if (SQLITE_ROW != ret) {
+					cur.done = true;
+					FMS_SQLITE_OK(db, ret == SQLITE_DONE ? SQLITE_OK : ret);
+				}
+			}
+		}
+		catch (const std::exception&) {
+			if (p.status == progress::completed) {
+				sqlite3_progress_handler(db, 0, nullptr, nullptr);
+				throw;
+			}
+		}
+		sqlite3_progress_handler(db, 0, nullptr, nullptr);
+
+		if (p.status == progress::completed && !cur.done) {
+			p.status = progress::row_limit;
+		}
+		p.rows = cur.rows;
+		p.vm_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+		p.elapsed = duration<double>(steady_clock::now() - p.start).count();
+	}
+
 	template<class O>
 	inline auto map(sqlite::iterator& i, O& o)
 	{
@@ -549,119 +1750,7 @@ namespace xll {
 		}
 	}
 
-	/* !!!
-	template<class X>
-	inline void bind(sqlite3_stmt* stmt, int i, const OPER& o, int type = 0)
-	{
-		if (o.is_nil()) {
-			sqlite3_bind_null(stmt, i);
-			return;
-		}
-
-		if (!type) {
-			type = sqltype(o.type());
-		}
-
-		switch (o.type()) {
-		case xltypeNum:
-			if (type == SQLITE_DATETIME) {
-				sqlite3_bind_int64(stmt, i, to_time_t(o.val.num));
-			}
-			else {
-				sqlite3_bind_double(stmt, i, o.as_num());
-			}
-			return;
-		case xltypeStr:
-			if constexpr (std::is_same_v<char, typename traits<X>::xchar>) {
-				sqlite3_bind_text(stmt, i, o.val.str + 1, o.val.str[0], SQLITE_TRANSIENT);
-			}
-			else {
-				sqlite3_bind_text16(stmt, i, o.val.str + 1, 2*o.val.str[0], SQLITE_TRANSIENT);
-			}
-			return;
-		case xltypeBool:
-			sqlite3_bind_int(stmt, i, o.val.xbool);
-			return;
-		case xltypeInt:
-			sqlite3_bind_int(stmt, i, o.val.w);
-			return;
-		}
-
-		ensure(!__FUNCTION__ ": invalid type");
-	}
-	*/
-	/*
-	inline OPER sqlite_exec(sqlite::stmt& stmt, bool no_headers)
-	{
-		OPER result;
-
-		int ret = stmt.step();
-
-		if (SQLITE_DONE == ret) {
-			result = to_handle<sqlite::stmt>(&stmt);
-		}
-		else if (SQLITE_ROW == ret) {
-			OPER row(1, stmt.as_count());
-
-			if (!no_headers) {
-				for (unsigned i = 0; i < row.columns(); ++i) {
-					row[i] = stmt.column_name(i);
-				}
-				result.push_bottom(row);
-			}
-
-			while (SQLITE_ROW == ret) {
-				for (unsigned i = 0; i < row.columns(); ++i) {
-					row[i] = column(stmt, i);
-				}
-				result.push_bottom(row);
-				ret = stmt.step();
-			}
-			ensure(SQLITE_DONE == ret || !__FUNCTION__ ": step not done");
-		}
-		else {
-			FMS_SQLITE_OK(sqlite3_db_handle(stmt), ret);
-		}
-
-		return result;
-	}
-	template<class X>
-	inline mem::OPER<X> sqlite_exec_mem(sqlite::stmt& stmt, bool no_headers)
-	{
-		using xchar = mem::traits<X>::xchar;
-		mem::OPER<X> result;
-
-		int ret = stmt.step();
-
-		if (SQLITE_DONE == ret) {
-			result = to_handle<sqlite::stmt>(&stmt);
-		}
-		else if (SQLITE_ROW == ret) {
-			int c = stmt.column_count();
-
-			if (!no_headers) {
-				for (int i = 0; i < c; ++i) {
-					result.push_back(OPER(stmt.column_name(i)));
-				}
-			}
-
-			while (SQLITE_ROW == ret) {
-				for (int i = 0; i < c; ++i) {
-					result.push_back(column(stmt, i));
-				}
-				ret = stmt.step();
-			}
-			ensure(SQLITE_DONE == ret || !__FUNCTION__ ": step not done");
-			ensure(result.size() % c == 0);
-			result.reshape(result.size() / c, c);
-		}
-		else {
-			FMS_SQLITE_OK(sqlite3_db_handle(stmt), ret);
-		}
-
-		return result;
-	}
-	*/
-
-
 } // namespace xll
+
+#include "xll_sqlite_range.h"
+#include "xll_sqlite_cache.h"
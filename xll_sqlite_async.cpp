@@ -0,0 +1,196 @@
+// xll_sqlite_async.cpp - asynchronous queries on a pool of worker threads
+#include "xll_sqlite.h"
+#include "xll_thread_pool.h"
+
+using namespace xll;
+
+namespace {
+
+	// Workers and the connections each one has opened.
+	struct async_pool {
+		// connections[i] is only used by worker i
+		std::vector<std::map<std::pair<std::string, int>, std::unique_ptr<sqlite::db>>> connections;
+		thread_pool pool; // joined before connections are closed
+
+		explicit async_pool(size_t n = thread_pool::concurrency())
+			: connections(n), pool(n)
+		{ }
+		async_pool(const async_pool&) = delete;
+		async_pool& operator=(const async_pool&) = delete;
+		// Statements cached for a connection are finalized before it closes.
+		~async_pool()
+		{
+			pool.shutdown();
+			for (auto& files : connections) {
+				for (auto& [key, db] : files) {
+					if (db) {
+						sqlite_states::erase(*db);
+					}
+				}
+			}
+		}
+
+		// Connection of worker i to file opened with flags.
+		sqlite3* connection(size_t i, const std::string& file, int flags)
+		{
+			auto& db = connections[i][{file, flags}];
+			if (!db) {
+				db = std::make_unique<sqlite::db>(file.c_str(), flags);
+				sqlite3_busy_timeout(*db, 5000);
+				create_modules(*db);
+			}
+
+			return *db;
+		}
+	};
+
+	std::mutex async_mutex;
+	std::unique_ptr<async_pool> async;
+
+	async_pool& get_async()
+	{
+		std::lock_guard<std::mutex> lock(async_mutex);
+		if (!async) {
+			async = std::make_unique<async_pool>();
+		}
+
+		return *async;
+	}
+
+	// Return result to the cell waiting on h.
+	void async_return(XLOPER12 h, mem::result<XLOPER12>& result)
+	{
+		XLOPER12 ret;
+		LPXLOPER12 px = result.release();
+		if (xlretSuccess != ::Excel12(xlAsyncReturn, &ret, 2, &h, px)) {
+			mem::pool<XLOPER12>::instance().release(px);
+		}
+	}
+
+	// Run sql on db and return the result to the cell waiting on h.
+	void query(sqlite3* db, const std::string& sql, XLOPER12 h)
+	{
+		mem::result<XLOPER12> result;
+
+		try {
+			ensure(db);
+			auto& st = state(db);
+			st.clear_if_requested();
+			auto stmt = st.stmts.get(db, sql);
+
+			xll::headers(*stmt, *result);
+			xll::map(*stmt, *result);
+		}
+		catch (const std::exception&) {
+			*result = mem::OPER12(xlerrNA);
+		}
+
+		async_return(h, result);
+	}
+
+	// Run sql on worker i's connection to file.
+	void query_job(async_pool& a, size_t i, const std::string& file, int flags, const std::string& sql, XLOPER12 h)
+	{
+		sqlite3* db = nullptr;
+		try {
+			db = a.connection(i, file, flags);
+		}
+		catch (const std::exception&) {
+			// query returns #N/A
+		}
+
+		query(db, sql, h);
+	}
+
+	// Queue sql against the file of db. If a worker connection would not see the
+	// same data as db, like SQL.QUERY, then run it now on db while it is locked.
+	void submit_query(sqlite3* db, std::string sql, XLOPER12 h)
+	{
+		std::string file;
+		int flags;
+		{
+			std::lock_guard<std::mutex> lock(state(db).mutex);
+			if (!connection::shareable(db)) {
+				query(db, sql, h);
+
+				return;
+			}
+			file = sqlite3_db_filename(db, "main");
+			flags = reopen_flags(db);
+		}
+
+		auto& a = get_async();
+		bool queued = a.pool.submit([&a, file = std::move(file), flags, sql = std::move(sql), h](size_t i) {
+			query_job(a, i, file, flags, sql, h);
+		});
+		ensure(queued || !"asynchronous query queue is full");
+	}
+
+} // namespace
+
+// Drop queued queries, wait for running ones, and close worker connections before the add-in is unloaded.
+Auto<Close> xac_sqlite_async([]() {
+	std::lock_guard<std::mutex> lock(async_mutex);
+	async.reset();
+
+	return TRUE;
+});
+
+AddIn xai_sqlite_query_async(
+	Function(XLL_VOID, "xll_sqlite_query_async", CATEGORY ".QUERY.ASYNC")
+	.Arguments({
+		Arg_db,
+		Arg_sql,
+		})
+	.Asynchronous()
+	.ThreadSafe()
+	.Category(CATEGORY)
+	.FunctionHelp("Return result of executing sql on a worker thread.")
+	.HelpTopic("https://www.sqlite.org/c3ref/query.html")
+);
+void WINAPI xll_sqlite_query_async(HANDLEX db, const LPOPER12 psql, LPXLOPER12 ph)
+{
+#pragma XLLEXPORT
+	try {
+		handle<sqlite_db> db_(db);
+		ensure(db_);
+
+		submit_query(*db_, to_string(*psql, " ", " "), *ph);
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+
+		XLOPER12 ret;
+		XLOPER12 err = { .val = {.err = xlerrNA}, .xltype = xltypeErr };
+		::Excel12(xlAsyncReturn, &ret, 2, ph, &err);
+	}
+}
+
+AddIn xai_sqlite_stmt_exec_async(
+	Function(XLL_VOID, "xll_sqlite_stmt_exec_async", CATEGORY ".EXEC.ASYNC")
+	.Arguments({
+		Arg_stmt,
+		})
+	.Asynchronous()
+	.ThreadSafe()
+	.Category(CATEGORY)
+	.FunctionHelp("Execute the expanded sql of a statement on a worker thread.")
+	.HelpTopic("https://www.sqlite.org/c3ref/exec.html")
+);
+void WINAPI xll_sqlite_stmt_exec_async(HANDLEX stmt, LPXLOPER12 ph)
+{
+#pragma XLLEXPORT
+	try {
+		handle<sqlite_stmt> stmt_(stmt);
+		ensure(stmt_);
+
+		submit_query(stmt_->db_handle(), stmt_->expanded_sql(), *ph);
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+
+		XLOPER12 ret;
+		XLOPER12 err = { .val = {.err = xlerrNA}, .xltype = xltypeErr };
+		::Excel12(xlAsyncReturn, &ret, 2, ph, &err);
+	}
+}
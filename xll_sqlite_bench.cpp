@@ -0,0 +1,360 @@
+// xll_sqlite_bench.cpp - timings of alternative implementations
+#include <chrono>
+#include <cstdio>
+#include "xll_sqlite.h"
+
+using namespace xll;
+
+namespace {
+
+	// Seconds taken by f().
+	template<class F>
+	double seconds(F&& f)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		f();
+		const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+
+		return dt.count();
+	}
+
+	// Range with r rows and c columns. Every fifth column is text, the rest are numbers.
+	OPER bench_data(unsigned r, unsigned c)
+	{
+		OPER data(r, c);
+		for (unsigned i = 0; i < r; ++i) {
+			for (unsigned j = 0; j < c; ++j) {
+				if (j % 5 == 4) {
+					data(i, j) = OPER(std::to_string(i * c + j).c_str());
+				}
+				else {
+					data(i, j) = OPER(i + j / 8.);
+				}
+			}
+		}
+
+		return data;
+	}
+
+	// Extended types of bench_data columns.
+	std::vector<int> bench_type(unsigned c)
+	{
+		std::vector<int> type(c);
+		for (unsigned j = 0; j < c; ++j) {
+			type[j] = j % 5 == 4 ? SQLITE_TEXT : SQLITE_FLOAT;
+		}
+
+		return type;
+	}
+
+	// Range with r rows and c columns of dates as yyyy-mm-dd strings, text, and numbers
+	// so most of the work is converting cells.
+	OPER pipeline_data(unsigned r, unsigned c)
+	{
+		OPER data(r, c);
+		char date[16];
+		for (unsigned i = 0; i < r; ++i) {
+			for (unsigned j = 0; j < c; ++j) {
+				if (j % 3 == 0) {
+					snprintf(date, sizeof(date), "%04u-%02u-%02u", 2000 + (i + j) % 30, 1 + (i + j) % 12, 1 + (i + j) % 28);
+					data(i, j) = OPER(date);
+				}
+				else if (j % 3 == 1) {
+					data(i, j) = OPER((std::string("text ") + std::to_string(i * c + j)).c_str());
+				}
+				else {
+					data(i, j) = OPER(i + j / 8.);
+				}
+			}
+		}
+
+		return data;
+	}
+
+	// Extended types of pipeline_data columns.
+	std::vector<int> pipeline_type(unsigned c)
+	{
+		std::vector<int> type(c);
+		for (unsigned j = 0; j < c; ++j) {
+			type[j] = j % 3 == 0 ? SQLITE_DATETIME : j % 3 == 1 ? SQLITE_TEXT : SQLITE_FLOAT;
+		}
+
+		return type;
+	}
+
+	// CREATE TABLE with columns c0, c1, ... having type.
+	void bench_table(sqlite3* db, const char* table, const std::vector<int>& type)
+	{
+		std::string sql = std::string("CREATE TABLE ") + table + " (";
+		for (unsigned j = 0; j < type.size(); ++j) {
+			sql.append(j ? ", c" : "c").append(std::to_string(j)).append(" ").append(sqlite::sqlname(type[j]));
+		}
+		sql.append(")");
+		FMS_SQLITE_OK(db, sqlite3_exec(db, sql.c_str(), NULL, NULL, NULL));
+	}
+
+	// Table of r rows with c columns of type set to value, an expression in i = 1, ..., r.
+	void decode_table(sqlite3* db, const char* table, const char* type, const char* value, unsigned r, unsigned c)
+	{
+		std::string create = std::string("CREATE TABLE ") + table + " (";
+		std::string select = "SELECT ";
+		for (unsigned j = 0; j < c; ++j) {
+			create.append(j ? ", c" : "c").append(std::to_string(j)).append(" ").append(type);
+			select.append(j ? ", " : "").append(value);
+		}
+		create.append(")");
+		FMS_SQLITE_OK(db, sqlite3_exec(db, create.c_str(), NULL, NULL, NULL));
+
+		const auto insert = std::string("WITH RECURSIVE r(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM r WHERE i < ")
+			+ std::to_string(r) + ") INSERT INTO " + table + " " + select + " FROM r";
+		FMS_SQLITE_OK(db, sqlite3_exec(db, insert.c_str(), NULL, NULL, NULL));
+	}
+
+} // namespace
+
+AddIn xai_sqlite_bench_insert(
+	Function(XLL_LPOPER, "xll_sqlite_bench_insert", CATEGORY ".BENCH.INSERT")
+	.Arguments({
+		Arg(XLL_LONG, "_rows", "is the optional number of rows. Default is 1000000."),
+		Arg(XLL_LONG, "_columns", "is the optional number of columns. Default is 20."),
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Return seconds and rows per second to insert a range one row at a time "
+		"and with multi-row VALUES into an in-memory database.")
+);
+LPOPER WINAPI xll_sqlite_bench_insert(LONG r, LONG c)
+{
+#pragma XLLEXPORT
+	static OPER result;
+
+	try {
+		result = ErrNA;
+		if (r <= 0) {
+			r = 1'000'000;
+		}
+		if (c <= 0) {
+			c = 20;
+		}
+
+		const OPER data = bench_data(r, c);
+		sqlite::db db("", SQLITE_OPEN_READWRITE | SQLITE_OPEN_MEMORY);
+
+		const auto type = bench_type(c);
+		bench_table(db, "row", type);
+		std::vector<int> index(c);
+		std::iota(index.begin(), index.end(), 1);
+		sqlite::stmt stmt(db);
+		stmt.prepare(insert_values("row", c, 1));
+		const double row = seconds([&]() { executemany(stmt, data, 0, index); });
+
+		bench_table(db, "batch", type);
+		const double batch = seconds([&]() { insert_batch(db, "batch", data, 0, type); });
+
+		result = OPER({
+			OPER("method"), OPER("seconds"), OPER("rows/sec"),
+			OPER("row"), OPER(row), OPER(r / row),
+			OPER("batch"), OPER(batch), OPER(r / batch),
+		});
+		result.resize(3, 3);
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+	}
+
+	return &result;
+}
+
+AddIn xai_sqlite_bench_pipeline(
+	Function(XLL_LPOPER, "xll_sqlite_bench_pipeline", CATEGORY ".BENCH.PIPELINE")
+	.Arguments({
+		Arg(XLL_LONG, "_rows", "is the optional number of rows. Default is 1000000."),
+		Arg(XLL_LONG, "_columns", "is the optional number of columns. Default is 12."),
+		Arg(XLL_LONG, "_threads", "is the optional number of converting threads. Default is one less than the number of cores."),
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Return seconds and rows per second to insert a range of dates, text, and numbers "
+		"converting cells on the inserting thread and on worker threads.")
+);
+LPOPER WINAPI xll_sqlite_bench_pipeline(LONG r, LONG c, LONG threads)
+{
+#pragma XLLEXPORT
+	static OPER result;
+
+	try {
+		result = ErrNA;
+		if (r <= 0) {
+			r = 1'000'000;
+		}
+		if (c <= 0) {
+			c = 12;
+		}
+
+		const OPER data = pipeline_data(r, c);
+		const auto type = pipeline_type(c);
+		sqlite::db db("", SQLITE_OPEN_READWRITE | SQLITE_OPEN_MEMORY);
+
+		bench_table(db, "batch", type);
+		const double batch = seconds([&]() { insert_batch(db, "batch", data, 0, type); });
+
+		bench_table(db, "pipeline", type);
+		const double pipeline = seconds([&]() { insert_pipeline(db, "pipeline", data, 0, type, std::max(0L, threads)); });
+
+		result = OPER({
+			OPER("method"), OPER("seconds"), OPER("rows/sec"),
+			OPER("batch"), OPER(batch), OPER(r / batch),
+			OPER("pipeline"), OPER(pipeline), OPER(r / pipeline),
+		});
+		result.resize(3, 3);
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+	}
+
+	return &result;
+}
+
+AddIn xai_sqlite_bench_decode(
+	Function(XLL_LPOPER, "xll_sqlite_bench_decode", CATEGORY ".BENCH.DECODE")
+	.Arguments({
+		Arg(XLL_LONG, "_rows", "is the optional number of rows. Default is 100000."),
+		Arg(XLL_LONG, "_columns", "is the optional number of columns. Default is 20."),
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Return seconds to convert numeric, text, and date query results "
+		"looking up the type of every value and using a decoder plan.")
+);
+LPOPER WINAPI xll_sqlite_bench_decode(LONG r, LONG c)
+{
+#pragma XLLEXPORT
+	static OPER result;
+
+	try {
+		result = ErrNA;
+		if (r <= 0) {
+			r = 100'000;
+		}
+		if (c <= 0) {
+			c = 20;
+		}
+
+		sqlite::db db("", SQLITE_OPEN_READWRITE | SQLITE_OPEN_MEMORY);
+		decode_table(db, "num", "FLOAT", "i * 0.5", r, c);
+		decode_table(db, "text", "TEXT", "'text ' || i", r, c);
+		decode_table(db, "date", "DATETIME", "946684800 + 86400 * i", r, c);
+
+		result = OPER({ OPER("result"), OPER("value"), OPER("plan"), OPER("speedup") });
+		for (const char* table : { "num", "text", "date" }) {
+			sqlite::stmt stmt(db);
+			stmt.prepare(std::string("SELECT * FROM ") + table);
+			std::vector<OPER> o;
+			o.reserve(static_cast<size_t>(r) * c);
+
+			const double value = seconds([&]() {
+				while (SQLITE_ROW == sqlite3_step(stmt)) {
+					for (int j = 0; j < c; ++j) {
+						o.push_back(as_oper(stmt[j]));
+					}
+				}
+			});
+			stmt.reset();
+			o.clear();
+			const double plan = seconds([&]() {
+				const decoder_plan plan(stmt);
+				while (SQLITE_ROW == sqlite3_step(stmt)) {
+					plan.row(stmt, o);
+				}
+			});
+
+			result.push_back(OPER(table));
+			result.push_back(OPER(value));
+			result.push_back(OPER(plan));
+			result.push_back(OPER(value / plan));
+		}
+		result.resize(4, 4);
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+	}
+
+	return &result;
+}
+
+AddIn xai_sqlite_bench_utf(
+	Function(XLL_LPOPER, "xll_sqlite_bench_utf", CATEGORY ".BENCH.UTF")
+	.Arguments({
+		Arg(XLL_LONG, "_cells", "is the optional number of strings. Default is 1000000."),
+		Arg(XLL_LONG, "_length", "is the optional number of characters in each string. Default is 24."),
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Return seconds to convert ASCII and accented strings between UTF-16 and UTF-8 "
+		"using the Windows code page functions and xll_utf.h.")
+);
+LPOPER WINAPI xll_sqlite_bench_utf(LONG n, LONG len)
+{
+#pragma XLLEXPORT
+	static OPER result;
+
+	try {
+		result = ErrNA;
+		if (n <= 0) {
+			n = 1'000'000;
+		}
+		if (len <= 0) {
+			len = 24;
+		}
+
+		result = OPER({ OPER("strings"), OPER("windows"), OPER("utf"), OPER("speedup") });
+		for (const bool accented : { false, true }) {
+			std::wstring w(len, L'a');
+			for (LONG i = 0; i < len; ++i) {
+				w[i] = static_cast<wchar_t>((accented && i % 4 == 3 ? 0xE0 : L'a') + i % 26);
+			}
+			const std::string u = wcstombs(w.c_str(), len);
+			const int m = static_cast<int>(u.size());
+			size_t check = 0; // keep the conversions from being optimized away
+
+			const double windows8 = seconds([&]() {
+				for (LONG i = 0; i < n; ++i) {
+					const int k = WideCharToMultiByte(CP_UTF8, 0, w.data(), len, NULL, 0, NULL, NULL);
+					std::string s(k, '\0');
+					WideCharToMultiByte(CP_UTF8, 0, w.data(), len, s.data(), k, NULL, NULL);
+					check += s.size();
+				}
+			});
+			const double utf8 = seconds([&]() {
+				for (LONG i = 0; i < n; ++i) {
+					check += utf::to_utf8_view(w.data(), len).size();
+				}
+			});
+			const double windows16 = seconds([&]() {
+				for (LONG i = 0; i < n; ++i) {
+					const int k = MultiByteToWideChar(CP_UTF8, 0, u.data(), m, NULL, 0);
+					std::wstring s(k, L'\0');
+					MultiByteToWideChar(CP_UTF8, 0, u.data(), m, s.data(), k);
+					check += s.size();
+				}
+			});
+			const double utf16 = seconds([&]() {
+				for (LONG i = 0; i < n; ++i) {
+					check += utf::to_utf16_view(u.data(), m).size();
+				}
+			});
+			ensure(check == 2 * n * (u.size() + w.size()) || !"conversions disagree");
+
+			result.push_back(OPER(accented ? "accented to UTF-8" : "ASCII to UTF-8"));
+			result.push_back(OPER(windows8));
+			result.push_back(OPER(utf8));
+			result.push_back(OPER(windows8 / utf8));
+			result.push_back(OPER(accented ? "accented to UTF-16" : "ASCII to UTF-16"));
+			result.push_back(OPER(windows16));
+			result.push_back(OPER(utf16));
+			result.push_back(OPER(windows16 / utf16));
+		}
+		result.resize(5, 4);
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+	}
+
+	return &result;
+}
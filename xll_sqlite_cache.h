@@ -0,0 +1,693 @@
+// xll_sqlite_cache.h - per connection caches
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include "xll_sqlite.h"
+
+namespace xll {
+
+	// Collapse white space outside of quotes and comments and trim.
+	inline std::string normalize_sql(std::string_view sql)
+	{
+		std::string s;
+		s.reserve(sql.size());
+
+		char q = 0; // closing quote if inside quotes or '\n' in a comment
+		bool space = false;
+		for (size_t i = 0; i < sql.size(); ++i) {
+			char c = sql[i];
+			if (q) {
+				s.push_back(c);
+				if (c == q) {
+					q = 0;
+				}
+			}
+			else if (isspace(static_cast<unsigned char>(c))) {
+				space = true;
+			}
+			else {
+				if (space && !s.empty() && s.back() != '\n') {
+					s.push_back(' ');
+				}
+				space = false;
+				s.push_back(c);
+				if (c == '\'' || c == '"' || c == '`') {
+					q = c;
+				}
+				else if (c == '[') {
+					q = ']';
+				}
+				else if (c == '-' && i + 1 < sql.size() && sql[i + 1] == '-') {
+					q = '\n';
+				}
+			}
+		}
+
+		return s;
+	}
+#ifdef _DEBUG
+	inline int test_normalize_sql()
+	{
+		try {
+			ensure(normalize_sql("") == "");
+			ensure(normalize_sql(" SELECT  *\n\tFROM t ") == "SELECT * FROM t");
+			ensure(normalize_sql("SELECT 'a  b'  FROM [x  y]") == "SELECT 'a  b' FROM [x  y]");
+			ensure(normalize_sql("SELECT \"a\n\" ,1") == "SELECT \"a\n\" ,1");
+			ensure(normalize_sql("SELECT 1 -- one\n  FROM t") == "SELECT 1 -- one\nFROM t");
+		}
+		catch (const std::exception& ex) {
+			XLL_ERROR(ex.what());
+
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+#endif // _DEBUG
+
+	// Built-in functions whose result only depends on their arguments.
+	inline bool deterministic_function(std::string_view name)
+	{
+		static const std::string_view functions[] = {
+			"abs", "acos", "acosh", "asin", "asinh", "atan", "atan2", "atanh", "avg",
+			"ceil", "ceiling", "char", "coalesce", "concat", "concat_ws", "cos", "cosh", "count",
+			"cume_dist", "degrees", "dense_rank", "exp", "first_value", "floor", "format",
+			"glob", "group_concat", "hex", "ifnull", "iif", "instr",
+			"json", "json_array", "json_array_length", "json_extract", "json_group_array",
+			"json_group_object", "json_insert", "json_object", "json_patch", "json_quote",
+			"json_remove", "json_replace", "json_set", "json_type", "json_valid",
+			"lag", "last_value", "lead", "length", "like", "likelihood", "likely", "ln",
+			"log", "log10", "log2", "lower", "ltrim", "max", "min", "mod", "nth_value", "ntile",
+			"nullif", "octet_length", "percent_rank", "pi", "pow", "power", "printf", "quote",
+			"radians", "rank", "replace", "round", "row_number", "rtrim", "sign", "sin", "sinh",
+			"soundex", "sqrt", "string_agg", "substr", "substring", "sum", "tan", "tanh", "total",
+			"trim", "trunc", "typeof", "unhex", "unicode", "unlikely", "upper", "zeroblob",
+		};
+		for (const auto& f : functions) {
+			if (f.size() == name.size() && _strnicmp(f.data(), name.data(), f.size()) == 0) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Authorizer recording if a statement calls a function that is not deterministic.
+	// Date and time functions read the clock when called without arguments or with 'now'
+	// so they are never deterministic, and neither are functions defined by users.
+	inline int deterministic_authorizer(void* pdet, int action, const char*, const char* name, const char*, const char*)
+	{
+		if (action == SQLITE_FUNCTION && !(name && deterministic_function(name))) {
+			*static_cast<bool*>(pdet) = false;
+		}
+
+		return SQLITE_OK;
+	}
+
+	// LRU cache of prepared statements keyed by normalized SQL.
+	class stmt_cache {
+		struct entry {
+			std::string sql;
+			std::unique_ptr<sqlite::stmt> stmt;
+			size_t bytes;
+			bool deterministic;
+		};
+		std::mutex mutex;
+		std::list<entry> lru; // most recently used first
+		std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+		size_t bytes_ = 0;
+
+		void evict()
+		{
+			while (!lru.empty() && (lru.size() > max_count || bytes_ > max_bytes)) {
+				bytes_ -= lru.back().bytes;
+				index.erase(lru.back().sql);
+				lru.pop_back();
+				++evictions;
+			}
+		}
+		// Return a statement to the cache.
+		void put(std::string sql, std::unique_ptr<sqlite::stmt> stmt, bool deterministic)
+		{
+			try {
+				stmt->reset();
+				stmt->clear_bindings();
+			}
+			catch (const std::exception&) {
+				return; // drop statements that fail to reset
+			}
+
+			const size_t n = sql.size()
+				+ sqlite3_stmt_status(*stmt, SQLITE_STMTSTATUS_MEMUSED, 0);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (index.contains(sql)) {
+				return; // another lease already returned one
+			}
+			lru.push_front(entry{ std::move(sql), std::move(stmt), n, deterministic });
+			index.emplace(lru.front().sql, lru.begin());
+			bytes_ += n;
+			evict();
+		}
+	public:
+		size_t max_count = 256;
+		size_t max_bytes = 1 << 24;
+		// counters are read by SQL.CACHE_STATS while other threads use the cache
+		std::atomic<size_t> hits = 0;
+		std::atomic<size_t> misses = 0;
+		std::atomic<size_t> evictions = 0;
+
+		// Prepared statement checked out of the cache.
+		class lease {
+			stmt_cache* cache;
+			std::string sql;
+			std::unique_ptr<sqlite::stmt> stmt;
+			bool deterministic_;
+		public:
+			lease(stmt_cache* cache, std::string sql, std::unique_ptr<sqlite::stmt> stmt, bool deterministic)
+				: cache(cache), sql(std::move(sql)), stmt(std::move(stmt)), deterministic_(deterministic)
+			{ }
+			lease(const lease&) = delete;
+			lease(lease&&) = default;
+			lease& operator=(const lease&) = delete;
+			lease& operator=(lease&&) = default;
+			~lease()
+			{
+				if (stmt) {
+					cache->put(std::move(sql), std::move(stmt), deterministic_);
+				}
+			}
+
+			// Statement only calls functions whose results depend on their arguments.
+			bool deterministic() const
+			{
+				return deterministic_;
+			}
+
+			sqlite::stmt& operator*()
+			{
+				return *stmt;
+			}
+			sqlite::stmt* operator->()
+			{
+				return stmt.get();
+			}
+		};
+
+		// Reset statement with cleared bindings for sql, preparing it on a miss.
+		lease get(sqlite3* db, std::string_view sql)
+		{
+			auto key = normalize_sql(sql);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				auto i = index.find(key);
+				if (i != index.end()) {
+					auto e = i->second;
+					auto stmt = std::move(e->stmt);
+					const bool deterministic = e->deterministic;
+					bytes_ -= e->bytes;
+					index.erase(i);
+					lru.erase(e);
+					++hits;
+
+					return lease(this, std::move(key), std::move(stmt), deterministic);
+				}
+				++misses;
+			}
+
+			// functions are resolved when the statement is prepared
+			bool deterministic = true;
+			auto stmt = std::make_unique<sqlite::stmt>(db);
+			sqlite3_set_authorizer(db, deterministic_authorizer, &deterministic);
+			try {
+				stmt->prepare(key);
+			}
+			catch (...) {
+				sqlite3_set_authorizer(db, nullptr, nullptr);
+				throw;
+			}
+			sqlite3_set_authorizer(db, nullptr, nullptr);
+
+			return lease(this, std::move(key), std::move(stmt), deterministic);
+		}
+
+		size_t size()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			return lru.size();
+		}
+		size_t bytes()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			return bytes_;
+		}
+		void clear()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			index.clear();
+			lru.clear();
+			bytes_ = 0;
+		}
+	};
+
+	// Results computed at the same version of a connection are unchanged.
+	struct data_version {
+		sqlite3_int64 data = 0;    // PRAGMA data_version: commits by other connections
+		sqlite3_int64 schema = 0;  // PRAGMA schema_version
+		sqlite3_int64 changes = 0; // sqlite3_total_changes64: changes by this connection
+
+		bool operator==(const data_version&) const = default;
+	};
+
+	inline data_version version(sqlite3* db, stmt_cache& stmts)
+	{
+		data_version v;
+
+		{
+			auto stmt = stmts.get(db, "PRAGMA data_version");
+			ensure(SQLITE_ROW == stmt->step());
+			v.data = (*stmt)[0].as_int();
+		}
+		{
+			auto stmt = stmts.get(db, "PRAGMA schema_version");
+			ensure(SQLITE_ROW == stmt->step());
+			v.schema = (*stmt)[0].as_int();
+		}
+		v.changes = sqlite3_total_changes64(db);
+
+		return v;
+	}
+
+	// Append a tagged copy of x to key.
+	inline void append_key(std::string& key, const XLOPER12& x)
+	{
+		key.push_back('\x1f');
+		key.append(reinterpret_cast<const char*>(&x.xltype), sizeof(x.xltype));
+		switch (x.xltype) {
+		case xltypeNum:
+			key.append(reinterpret_cast<const char*>(&x.val.num), sizeof(x.val.num));
+			break;
+		case xltypeStr:
+			key.append(reinterpret_cast<const char*>(x.val.str), (1 + x.val.str[0]) * sizeof(XCHAR));
+			break;
+		case xltypeBool:
+			key.push_back(x.val.xbool ? 1 : 0);
+			break;
+		case xltypeErr:
+			key.append(reinterpret_cast<const char*>(&x.val.err), sizeof(x.val.err));
+			break;
+		case xltypeInt:
+			key.append(reinterpret_cast<const char*>(&x.val.w), sizeof(x.val.w));
+			break;
+		case xltypeMulti:
+			key.append(reinterpret_cast<const char*>(&x.val.array.rows), sizeof(x.val.array.rows));
+			key.append(reinterpret_cast<const char*>(&x.val.array.columns), sizeof(x.val.array.columns));
+			for (size_t i = 0; i < (size_t)x.val.array.rows * x.val.array.columns; ++i) {
+				append_key(key, x.val.array.lparray[i]);
+			}
+			break;
+		}
+	}
+
+	// Cache of query results keyed by SQL and bound values.
+	class result_cache {
+		struct entry {
+			std::string key;
+			data_version version;
+			std::shared_ptr<mem::arena<XLOPER12>> result;
+			size_t bytes;
+		};
+		std::mutex mutex;
+		std::list<entry> lru; // most recently used first
+		std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+		size_t bytes_ = 0;
+
+		void erase(std::list<entry>::iterator e)
+		{
+			bytes_ -= e->bytes;
+			index.erase(e->key);
+			lru.erase(e);
+		}
+		void evict()
+		{
+			while (!lru.empty() && bytes_ > max_bytes) {
+				erase(std::prev(lru.end()));
+				++evictions;
+			}
+		}
+	public:
+		std::atomic<size_t> max_bytes = 1 << 26;
+		// counters are read by SQL.CACHE_STATS while other threads use the cache
+		std::atomic<size_t> hits = 0;
+		std::atomic<size_t> misses = 0;
+		std::atomic<size_t> invalidations = 0;
+		std::atomic<size_t> evictions = 0;
+
+		// Key for sql with optional bound values.
+		static std::string key(std::string_view sql, const XLOPER12* values = nullptr)
+		{
+			auto k = normalize_sql(sql);
+			if (values) {
+				append_key(k, *values);
+			}
+
+			return k;
+		}
+
+		// Cached result for key computed at version v, or null.
+		std::shared_ptr<mem::arena<XLOPER12>> find(const std::string& key, const data_version& v)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			auto i = index.find(key);
+			if (i == index.end()) {
+				++misses;
+
+				return nullptr;
+			}
+
+			auto e = i->second;
+			if (!(e->version == v)) {
+				erase(e);
+				++invalidations;
+				++misses;
+
+				return nullptr;
+			}
+
+			lru.splice(lru.begin(), lru, e);
+			++hits;
+
+			return e->result;
+		}
+
+		// Store a copy of x computed at version v.
+		void put(const std::string& key, const data_version& v, const XLOPER12& x)
+		{
+			if (max_bytes == 0) {
+				return;
+			}
+
+			auto [n, m] = mem::count(x);
+			const size_t b = key.size() + n * sizeof(XLOPER12) + m * sizeof(XCHAR);
+			if (b > max_bytes) {
+				return;
+			}
+			std::shared_ptr<mem::arena<XLOPER12>> a = mem::clone(x);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			auto i = index.find(key);
+			if (i != index.end()) {
+				erase(i->second);
+			}
+			lru.push_front(entry{ key, v, std::move(a), b });
+			index.emplace(lru.front().key, lru.begin());
+			bytes_ += b;
+			evict();
+		}
+
+		size_t size()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			return lru.size();
+		}
+		size_t bytes()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			return bytes_;
+		}
+		void clear()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			index.clear();
+			lru.clear();
+			bytes_ = 0;
+		}
+		// Set max_bytes and evict down to it. 0 disables caching.
+		void budget(size_t n)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			max_bytes = n;
+			evict();
+		}
+	};
+
+	// Cached result at the front of an arena.
+	inline const XLOPER12& front(const mem::arena<XLOPER12>& a)
+	{
+		return a.xloper.buf[0];
+	}
+
+	// State kept for each connection.
+	// Erased before the connection closes since cached statements keep it open.
+	struct sqlite_state {
+		stmt_cache stmts;
+		result_cache results;
+		progress last; // limits and outcome of the last SQL.QUERY
+		bulk_timing bulk; // phases of the last bulk load
+		int flags = 0; // SQLITE_OPEN_* flags the connection was opened with
+		std::mutex mutex; // held while a shared connection is in use
+		std::atomic<bool> clear_requested = false; // by a thread not using the connection
+
+		data_version version(sqlite3* db)
+		{
+			return xll::version(db, stmts);
+		}
+		// Clear the caches if another thread asked to. Statements are only
+		// finalized by the thread using the connection.
+		void clear_if_requested()
+		{
+			if (clear_requested.exchange(false)) {
+				stmts.clear();
+				results.clear();
+			}
+		}
+	};
+
+	class sqlite_states {
+		static inline std::mutex mutex;
+		static inline std::map<sqlite3*, std::unique_ptr<sqlite_state>> states;
+	public:
+		static sqlite_state& get(sqlite3* db)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto& s = states[db];
+			if (!s) {
+				s = std::make_unique<sqlite_state>();
+			}
+
+			return *s;
+		}
+		static void erase(sqlite3* db)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			states.erase(db);
+		}
+		static void clear()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			states.clear();
+		}
+		// Call f with the state of db and of every other connection to the same file,
+		// such as the per-thread connections opened for calc threads.
+		template<class F>
+		static void for_each(sqlite3* db, F&& f)
+		{
+			const char* file = sqlite3_db_filename(db, "main");
+			const std::string_view name(file ? file : "");
+
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& [db_, s] : states) {
+				const char* file_ = sqlite3_db_filename(db_, "main");
+				if (db_ == db || (!name.empty() && file_ && name == file_)) {
+					f(*s);
+				}
+			}
+		}
+	};
+
+	inline sqlite_state& state(sqlite3* db)
+	{
+		return sqlite_states::get(db);
+	}
+
+	// Flags for another connection to the file of db with the same access
+	// that is only used by one thread at a time.
+	inline int reopen_flags(sqlite3* db)
+	{
+		const int keep = SQLITE_OPEN_NOFOLLOW | SQLITE_OPEN_PRIVATECACHE | SQLITE_OPEN_EXRESCODE;
+		const int access = sqlite3_db_readonly(db, "main") == 1 ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE;
+
+		return (state(db).flags & keep) | access | SQLITE_OPEN_NOMUTEX;
+	}
+
+	// Connection to use for db on the calling thread.
+	// Calc threads get their own connection to a database file so thread-safe
+	// functions run concurrently. Otherwise db is shared and its state is locked.
+	class connection {
+		sqlite3* db;
+		sqlite3* original;
+		std::unique_lock<std::mutex> lock;
+
+		struct local {
+			std::string file;
+			std::unique_ptr<sqlite::db> db;
+		};
+		static inline std::mutex mutex;
+		static inline std::map<std::pair<std::thread::id, sqlite3*>, local> locals;
+	public:
+		// A new connection only sees committed data in the main database so db can
+		// not be shared while it has a transaction open, attached databases, or
+		// temporary tables and views such as xl_range tables. Call with db locked.
+		static bool shareable(sqlite3* db)
+		{
+			const char* file = sqlite3_db_filename(db, "main");
+			if (!file || !*file || sqlite3_db_name(db, 2) || !sqlite3_get_autocommit(db)) {
+				return false;
+			}
+
+			sqlite::stmt stmt(db);
+			stmt.prepare("SELECT 1 FROM temp.sqlite_master LIMIT 1");
+
+			return SQLITE_DONE == stmt.step();
+		}
+
+		// Thread the add-in was loaded on.
+		static inline const std::thread::id main_thread = std::this_thread::get_id();
+
+		explicit connection(sqlite3* db)
+			: db(db), original(db), lock(state(db).mutex)
+		{
+			const auto id = std::this_thread::get_id();
+			if (id == main_thread || !shareable(db)) {
+				state(db).clear_if_requested();
+
+				return;
+			}
+			const int flags = reopen_flags(db);
+			lock.unlock();
+			const size_t budget = state(db).results.max_bytes;
+
+			const std::string file = sqlite3_db_filename(db, "main");
+			std::lock_guard<std::mutex> guard(mutex);
+			auto& l = locals[{id, db}];
+			if (!l.db || l.file != file) {
+				if (l.db) {
+					sqlite_states::erase(*l.db);
+				}
+				l.db = std::make_unique<sqlite::db>(file.c_str(), flags);
+				l.file = file;
+				sqlite3_busy_timeout(*l.db, 5000);
+				create_modules(*l.db);
+				state(*l.db).results.budget(budget);
+			}
+			this->db = *l.db;
+			state(this->db).clear_if_requested();
+		}
+		connection(const connection&) = delete;
+		connection& operator=(const connection&) = delete;
+
+		operator sqlite3*() const
+		{
+			return db;
+		}
+
+		// Record the outcome of a query on the original connection.
+		void last(const progress& p)
+		{
+			auto& s = state(original);
+			if (lock.owns_lock()) {
+				s.last = p;
+			}
+			else {
+				std::lock_guard<std::mutex> guard(s.mutex);
+				s.last = p;
+			}
+		}
+
+		// Close the per-thread connections opened for db.
+		static void erase(sqlite3* db)
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			for (auto i = locals.begin(); i != locals.end(); ) {
+				if (i->first.second == db) {
+					sqlite_states::erase(*i->second.db);
+					i = locals.erase(i);
+				}
+				else {
+					++i;
+				}
+			}
+		}
+		// Close all per-thread connections.
+		static void clear()
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			for (auto& [key, l] : locals) {
+				sqlite_states::erase(*l.db);
+			}
+			locals.clear();
+		}
+	};
+
+	// Connection owned by a \SQL.DB handle.
+	// Its per-thread connections and cached statements are dropped before it is closed.
+	class sqlite_db : public sqlite::db {
+	public:
+		sqlite_db(const char* filename, int flags)
+			: sqlite::db(filename, flags)
+		{
+			state(*this).flags = flags;
+		}
+		sqlite_db(const sqlite_db&) = delete;
+		sqlite_db& operator=(const sqlite_db&) = delete;
+		~sqlite_db()
+		{
+			connection::erase(*this);
+			sqlite_states::erase(*this);
+		}
+	};
+
+#ifdef _DEBUG
+	inline int test_sqlite_states()
+	{
+		try {
+			XLOPER12 one = { .val = {.num = 1}, .xltype = xltypeNum };
+			for (int i = 0; i < 2; ++i) {
+				// the next connection often reuses the address of the last one
+				sqlite_db db("", SQLITE_OPEN_READWRITE | SQLITE_OPEN_MEMORY);
+				auto& st = state(db);
+				ensure(st.stmts.size() == 0);
+				ensure(st.results.size() == 0);
+
+				const auto key = result_cache::key("SELECT 1");
+				const auto v = st.version(db);
+				st.results.put(key, v, one);
+				ensure(st.results.find(key, v));
+				ensure(st.stmts.size() == 2);
+			}
+		}
+		catch (const std::exception& ex) {
+			XLL_ERROR(ex.what());
+
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+#endif // _DEBUG
+
+} // namespace xll
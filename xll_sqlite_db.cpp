@@ -1,5 +1,6 @@
 ﻿// xll_sqlite_db.cpp - Sqlite3 bindings.
 #include <format>
+#include "xll_csv.h"
 #include "xll_sqlite.h"
 
 using namespace xll;
@@ -7,8 +8,40 @@ using namespace xll;
 #ifdef _DEBUG
 Auto<Open> xao_test_is_str_date(test_is_str_date);
 Auto<Open> xao_test_guess_one_sqlite_type(test_guess_one_sqlite_type);
+Auto<Open> xao_test_infer_sqltypes(test_infer_sqltypes);
+Auto<Open> xao_test_executemany(test_executemany);
+Auto<Open> xao_test_declared_type(xl_range::test_declared_type);
+Auto<Open> xao_test_normalize_sql(test_normalize_sql);
+Auto<Open> xao_test_sqlite_states(test_sqlite_states);
+Auto<Open> xao_test_parse_number(test_parse_number);
+Auto<Open> xao_test_spsc_ring(test_spsc_ring);
+// Report what failed in tests of headers that do not depend on xll.
+template<int(*test)()>
+inline int report_test()
+{
+	try {
+		return test();
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+	}
+
+	return FALSE;
+}
+Auto<Open> xao_test_csv(report_test<csv::test_csv>);
+Auto<Open> xao_test_datetime(report_test<datetime::test_datetime>);
+Auto<Open> xao_test_utf(report_test<utf::test_utf>);
+Auto<Open> xao_test_mem_view(report_test<Win::test_mem_view>);
 #endif // _DEBUG
 
+// Close per-thread connections and finalize cached statements before the add-in is unloaded.
+Auto<Close> xac_sqlite_states([]() {
+	connection::clear();
+	sqlite_states::clear();
+
+	return TRUE;
+});
+
 #if 0
 // get full filename path and strip out Debug or Release and 64-bit builds
 static const char* fullpath(const char* filename)
@@ -109,8 +142,9 @@ HANDLEX WINAPI xll_sqlite_db(const char* filename, LONG flags)
 	HANDLEX result = INVALID_HANDLEX;
 
 	try {
-		handle<sqlite::db> h(new sqlite::db(filename, flags));
+		handle<sqlite_db> h(new sqlite_db(filename, flags));
 		ensure(h);
+		FMS_SQLITE_OK(*h, create_modules(*h));
 		result = h.get();
 	}
 	catch (const std::exception& ex) {
@@ -126,6 +160,7 @@ AddIn xai_sqlite_schema(
 		Arg_db,
 		Arg(XLL_CSTRING4, "_name", "is the optional table name.")
 		})
+	.ThreadSafe()
 	.Category(CATEGORY)
 	.FunctionHelp("Return information from sqlite_schema and table if name is specified.")
 	.HelpTopic("https://www.sqlite.org/schematab.html")
@@ -133,24 +168,36 @@ AddIn xai_sqlite_schema(
 LPOPER WINAPI xll_sqlite_schema(HANDLEX db, const char* name)
 {
 #pragma XLLEXPORT
-	static OPER result;
+	static thread_local OPER result;
 
 	try {
 		result = ErrNA;
-		handle<sqlite::db> db_(db);
+		handle<sqlite_db> db_(db);
 		ensure(db_);
 
-		sqlite::stmt stmt(*db_);
+		connection conn(*db_);
+		sqlite::stmt stmt(conn);
 
 		auto sql = std::string("SELECT * FROM sqlite_schema ")
 			+ (*name ? std::string("WHERE name = ") + sqlite::variable_name(name) : " ")
 			+ "ORDER BY tbl_name, type DESC, name";
 
-		stmt.prepare(sql);
+		auto& st = state(conn);
+		const auto key = result_cache::key(sql);
+		const auto v = st.version(conn);
+
+		if (auto cached = st.results.find(key, v)) {
+			result = OPER(front(*cached));
+		}
+		else {
+			stmt.prepare(sql);
 
-		result = OPER{};
-		xll::headers(stmt, result);
-		xll::map(stmt, result);
+			result = OPER{};
+			xll::headers(stmt, result);
+			xll::map(stmt, result);
+
+			st.results.put(key, v, result);
+		}
 	}
 	catch (const std::exception& ex) {
 		XLL_ERROR(ex.what());
@@ -159,12 +206,31 @@ LPOPER WINAPI xll_sqlite_schema(HANDLEX db, const char* name)
 	return &result;
 }
 
+// Pragmas whose result only depends on the schema and data.
+inline bool cacheable_pragma(std::string_view pragma)
+{
+	static const std::string_view cacheable[] = {
+		"compile_options", "foreign_key_list", "index_info", "index_list", "index_xinfo",
+		"pragma_list", "table_info", "table_list", "table_xinfo",
+	};
+
+	const auto name = pragma.substr(0, pragma.find_first_of("( =;"));
+	for (const auto& c : cacheable) {
+		if (name == c) {
+			return pragma.find('=') == std::string_view::npos;
+		}
+	}
+
+	return false;
+}
+
 AddIn xai_sqlite_pragma(
 	Function(XLL_LPOPER, "xll_sqlite_pragma", CATEGORY ".PRAGMA")
 	.Arguments({
 		Arg(XLL_HANDLEX, "db", "is a handle to a sqlite database."),
 		Arg(XLL_CSTRING4, "_pragma", "is an optional pragma name."),
 		})
+	.ThreadSafe()
 	.Category(CATEGORY)
 	.FunctionHelp("Call 'PRAGMA pragma' or return all pragmas if omitted.")
 	.HelpTopic("https://www.sqlite.org/pragma.html")
@@ -172,22 +238,37 @@ AddIn xai_sqlite_pragma(
 LPOPER WINAPI xll_sqlite_pragma(HANDLEX db, const char* pragma)
 {
 #pragma XLLEXPORT
-	static OPER result;
+	static thread_local OPER result;
 
 	try {
 		result = ErrNA;
-		handle<sqlite::db> db_(db);
+		handle<sqlite_db> db_(db);
 		ensure(db_);
 
 		auto sql = std::string("PRAGMA ")
 			+ (*pragma ? pragma : "pragma_list");
 
-		sqlite::stmt stmt(*db_);
-		stmt.prepare(sql);
+		connection conn(*db_);
+		auto& st = state(conn);
+		const bool cache = cacheable_pragma(*pragma ? pragma : "pragma_list");
+		const auto key = result_cache::key(sql);
+		const auto v = st.version(conn);
+
+		if (auto cached = cache ? st.results.find(key, v) : nullptr) {
+			result = OPER(front(*cached));
+		}
+		else {
+			sqlite::stmt stmt(conn);
+			stmt.prepare(sql);
+
+			result = OPER{};
+			xll::headers(stmt, result);
+			xll::map(stmt, result);
 
-		result = OPER{};
-		xll::headers(stmt, result);
-		xll::map(stmt, result);
+			if (cache) {
+				st.results.put(key, v, result);
+			}
+		}
 	}
 	catch (const std::exception& ex) {
 		XLL_ERROR(ex.what());
@@ -201,6 +282,7 @@ AddIn xai_sqlite_table_list(
 	.Arguments({
 		Arg_db,
 		})
+	.ThreadSafe()
 	.Category(CATEGORY)
 	.FunctionHelp("Call PRAGMA table_list.")
 	.HelpTopic("https://www.sqlite.org/pragma.html#pragma_table_list")
@@ -218,6 +300,7 @@ AddIn xai_sqlite_table_info(
 		Arg_db,
 		Arg(XLL_CSTRING4, "name", "is the name of the table."),
 		})
+	.ThreadSafe()
 	.Category(CATEGORY)
 	.FunctionHelp("Call PRAGMA table_info(table).")
 	.HelpTopic("https://www.sqlite.org/pragma.html#pragma_table_info")
@@ -225,9 +308,119 @@ AddIn xai_sqlite_table_info(
 LPOPER WINAPI xll_sqlite_table_info(HANDLEX db, const char* table)
 {
 #pragma XLLEXPORT
-	handle<sqlite::db> db_(db);
-
 	auto pragma = std::string("table_info(") + sqlite::table_name(table) + ")";
 
 	return xll_sqlite_pragma(db, pragma.c_str());
 }
+
+AddIn xai_sqlite_cache_stats(
+	Function(XLL_LPOPER, "xll_sqlite_cache_stats", CATEGORY ".CACHE_STATS")
+	.Arguments({
+		Arg_db,
+		Arg(XLL_BOOL, "_clear", "is an optional boolean indicating the cache should be cleared."),
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Return prepared statement and result cache statistics as key-value pairs.")
+);
+LPOPER WINAPI xll_sqlite_cache_stats(HANDLEX db, BOOL clear)
+{
+#pragma XLLEXPORT
+	static OPER result;
+
+	try {
+		result = ErrNA;
+		handle<sqlite_db> db_(db);
+		ensure(db_);
+
+		if (clear) {
+			// connections of other threads are cleared by their thread when next used
+			sqlite_states::for_each(*db_, [](sqlite_state& st) {
+				st.clear_requested = true;
+			});
+			auto& st = state(*db_);
+			std::lock_guard<std::mutex> lock(st.mutex);
+			st.clear_if_requested();
+		}
+
+		// totals over db and the per-thread connections to the same file
+		// read from atomic counters and under each cache's own mutex
+		double stats[11] = {};
+		sqlite_states::for_each(*db_, [&](sqlite_state& st) {
+			const size_t s[] = {
+				st.stmts.hits, st.stmts.misses, st.stmts.evictions, st.stmts.size(), st.stmts.bytes(),
+				st.results.hits, st.results.misses, st.results.invalidations, st.results.evictions,
+				st.results.size(), st.results.bytes(),
+			};
+			for (size_t i = 0; i < std::size(s); ++i) {
+				stats[i] += static_cast<double>(s[i]);
+			}
+		});
+
+		result = OPER({
+			OPER("stmt hits"), OPER(stats[0]),
+			OPER("stmt misses"), OPER(stats[1]),
+			OPER("stmt evictions"), OPER(stats[2]),
+			OPER("stmt count"), OPER(stats[3]),
+			OPER("stmt bytes"), OPER(stats[4]),
+			OPER("result hits"), OPER(stats[5]),
+			OPER("result misses"), OPER(stats[6]),
+			OPER("result invalidations"), OPER(stats[7]),
+			OPER("result evictions"), OPER(stats[8]),
+			OPER("result count"), OPER(stats[9]),
+			OPER("result bytes"), OPER(stats[10]),
+			OPER("result budget"), OPER((double)state(*db_).results.max_bytes),
+		});
+		result.resize(12, 2);
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+	}
+
+	return &result;
+}
+
+AddIn xai_sqlite_value_fallbacks(
+	Function(XLL_DOUBLE, "xll_sqlite_value_fallbacks", CATEGORY ".VALUE_FALLBACKS")
+	.Arguments({
+		Arg(XLL_BOOL, "_clear", "is an optional boolean indicating the count should be reset."),
+		})
+	.ThreadSafe()
+	.Category(CATEGORY)
+	.FunctionHelp("Return the number of cells converted to numbers by calling VALUE in Excel.")
+);
+double WINAPI xll_sqlite_value_fallbacks(BOOL clear)
+{
+#pragma XLLEXPORT
+	return static_cast<double>(clear ? value_fallbacks.exchange(0) : value_fallbacks.load());
+}
+
+AddIn xai_sqlite_result_cache(
+	Function(XLL_HANDLEX, "xll_sqlite_result_cache", CATEGORY ".RESULT_CACHE")
+	.Arguments({
+		Arg_db,
+		Arg(XLL_DOUBLE, "max_bytes", "is the result cache budget in bytes. Use 0 to disable caching."),
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Set the size budget of the result cache used by SQL.QUERY, SQL.SCHEMA, and SQL.PRAGMA.")
+);
+HANDLEX WINAPI xll_sqlite_result_cache(HANDLEX db, double max_bytes)
+{
+#pragma XLLEXPORT
+	try {
+		handle<sqlite_db> db_(db);
+		ensure(db_);
+		ensure(max_bytes >= 0);
+
+		// per-thread connections opened later copy the budget of db
+		sqlite_states::for_each(*db_, [max_bytes](sqlite_state& st) {
+			st.results.budget(static_cast<size_t>(max_bytes));
+		});
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+
+		db = INVALID_HANDLEX;
+	}
+
+	return db;
+}
@@ -0,0 +1,382 @@
+// xll_sqlite_export.h - stream statement results to files
+#pragma once
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include "xll_sqlite.h"
+
+namespace xll {
+
+	// Output file with a fixed size buffer so memory use does not depend on the data.
+	class file_writer {
+		std::ofstream os;
+		std::vector<char> buf;
+		size_t len = 0;
+		size_t total = 0;
+	public:
+		explicit file_writer(const char* file, size_t size = 1 << 20)
+			: os(file, std::ios::binary | std::ios::trunc), buf(size)
+		{
+			ensure(os || !"file_writer: failed to open file");
+		}
+		file_writer(const file_writer&) = delete;
+		file_writer& operator=(const file_writer&) = delete;
+		~file_writer()
+		{
+			if (len) {
+				os.write(buf.data(), len);
+			}
+		}
+
+		// Bytes written.
+		size_t bytes() const
+		{
+			return total + len;
+		}
+
+		void flush()
+		{
+			os.write(buf.data(), len);
+			ensure(os || !"file_writer: failed to write file");
+			total += len;
+			len = 0;
+		}
+
+		file_writer& write(const char* s, size_t n)
+		{
+			if (len + n > buf.size()) {
+				flush();
+				if (n > buf.size()) {
+					os.write(s, n);
+					ensure(os || !"file_writer: failed to write file");
+					total += n;
+
+					return *this;
+				}
+			}
+			std::memcpy(buf.data() + len, s, n);
+			len += n;
+
+			return *this;
+		}
+		file_writer& write(std::string_view s)
+		{
+			return write(s.data(), s.size());
+		}
+		file_writer& put(char c)
+		{
+			if (len == buf.size()) {
+				flush();
+			}
+			buf[len++] = c;
+
+			return *this;
+		}
+		// Shortest representation that reads back the same.
+		template<class T>
+			requires std::is_arithmetic_v<T>
+		file_writer& number(T t)
+		{
+			char s[32];
+			const auto [p, ec] = std::to_chars(s, s + sizeof(s), t);
+
+			return write(s, p - s);
+		}
+		// Native bytes of t.
+		template<class T>
+		file_writer& raw(const T& t)
+		{
+			return write(reinterpret_cast<const char*>(&t), sizeof(T));
+		}
+	};
+
+	enum class export_format { csv, jsonl, binary };
+
+	// Format from its name or the file extension if name is empty.
+	inline export_format to_export_format(const char* name, const char* file)
+	{
+		std::string_view f(name);
+		if (f.empty()) {
+			f = file;
+			const auto dot = f.rfind('.');
+			f = dot == std::string_view::npos ? "" : f.substr(dot + 1);
+		}
+		const std::string n(f);
+		if (n.empty() || _stricmp(n.c_str(), "csv") == 0) {
+			return export_format::csv;
+		}
+		if (_stricmp(n.c_str(), "jsonl") == 0 || _stricmp(n.c_str(), "json") == 0) {
+			return export_format::jsonl;
+		}
+		if (_stricmp(n.c_str(), "bin") == 0 || _stricmp(n.c_str(), "binary") == 0) {
+			return export_format::binary;
+		}
+		ensure(!"format must be CSV, JSONL, or BINARY");
+
+		return export_format::csv;
+	}
+
+	inline void write_hex(file_writer& w, const void* p, int n)
+	{
+		static constexpr char hex[] = "0123456789abcdef";
+		const auto b = static_cast<const unsigned char*>(p);
+		for (int i = 0; i < n; ++i) {
+			w.put(hex[b[i] >> 4]).put(hex[b[i] & 0xF]);
+		}
+	}
+
+	// RFC 4180 field. Quoted only if it has a comma, quote, or line break.
+	inline void write_csv(file_writer& w, std::string_view s)
+	{
+		if (s.find_first_of(",\"\r\n") == std::string_view::npos) {
+			w.write(s);
+
+			return;
+		}
+		w.put('"');
+		for (char c : s) {
+			if (c == '"') {
+				w.put('"');
+			}
+			w.put(c);
+		}
+		w.put('"');
+	}
+
+	inline void write_json(file_writer& w, std::string_view s)
+	{
+		static constexpr char hex[] = "0123456789abcdef";
+		w.put('"');
+		for (char c : s) {
+			switch (c) {
+			case '"': w.write("\\\""); break;
+			case '\\': w.write("\\\\"); break;
+			case '\n': w.write("\\n"); break;
+			case '\r': w.write("\\r"); break;
+			case '\t': w.write("\\t"); break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20) {
+					w.write("\\u00").put(hex[c >> 4]).put(hex[c & 0xF]);
+				}
+				else {
+					w.put(c);
+				}
+			}
+		}
+		w.put('"');
+	}
+
+	inline std::string_view column_text(sqlite3_stmt* stmt, int j)
+	{
+		const auto p = reinterpret_cast<const char*>(sqlite3_column_text(stmt, j));
+
+		return p ? std::string_view(p, sqlite3_column_bytes(stmt, j)) : std::string_view();
+	}
+
+	// Header row then one line per row. NULL is an empty field and blobs are hex.
+	inline size_t export_csv(sqlite3_stmt* stmt, file_writer& w)
+	{
+		const int c = sqlite3_column_count(stmt);
+		for (int j = 0; j < c; ++j) {
+			if (j) {
+				w.put(',');
+			}
+			write_csv(w, sqlite3_column_name(stmt, j));
+		}
+		w.write("\r\n");
+
+		size_t rows = 0;
+		int ret;
+		while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+			for (int j = 0; j < c; ++j) {
+				if (j) {
+					w.put(',');
+				}
+				switch (sqlite3_column_type(stmt, j)) {
+				case SQLITE_INTEGER:
+					w.number(sqlite3_column_int64(stmt, j));
+					break;
+				case SQLITE_FLOAT:
+					w.number(sqlite3_column_double(stmt, j));
+					break;
+				case SQLITE_TEXT:
+					write_csv(w, column_text(stmt, j));
+					break;
+				case SQLITE_BLOB:
+					write_hex(w, sqlite3_column_blob(stmt, j), sqlite3_column_bytes(stmt, j));
+					break;
+				}
+			}
+			w.write("\r\n");
+			++rows;
+		}
+		FMS_SQLITE_OK(sqlite3_db_handle(stmt), ret == SQLITE_DONE ? SQLITE_OK : ret);
+
+		return rows;
+	}
+
+	// One JSON object per line keyed by column name. Infinities are null and blobs are hex strings.
+	inline size_t export_jsonl(sqlite3_stmt* stmt, file_writer& w)
+	{
+		const int c = sqlite3_column_count(stmt);
+		size_t rows = 0;
+		int ret;
+		while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+			w.put('{');
+			for (int j = 0; j < c; ++j) {
+				if (j) {
+					w.put(',');
+				}
+				write_json(w, sqlite3_column_name(stmt, j));
+				w.put(':');
+				switch (sqlite3_column_type(stmt, j)) {
+				case SQLITE_INTEGER:
+					w.number(sqlite3_column_int64(stmt, j));
+					break;
+				case SQLITE_FLOAT: {
+					const double d = sqlite3_column_double(stmt, j);
+					if (std::isfinite(d)) {
+						w.number(d);
+					}
+					else {
+						w.write("null");
+					}
+					break;
+				}
+				case SQLITE_TEXT:
+					write_json(w, column_text(stmt, j));
+					break;
+				case SQLITE_BLOB:
+					w.put('"');
+					write_hex(w, sqlite3_column_blob(stmt, j), sqlite3_column_bytes(stmt, j));
+					w.put('"');
+					break;
+				default:
+					w.write("null");
+				}
+			}
+			w.write("}\n");
+			++rows;
+		}
+		FMS_SQLITE_OK(sqlite3_db_handle(stmt), ret == SQLITE_DONE ? SQLITE_OK : ret);
+
+		return rows;
+	}
+
+	// Typed columnar file in native byte order:
+	//   "XLLSQLB1", uint32 columns, then uint32 length and UTF-8 bytes of each column name.
+	//   Groups of at most group rows, each a uint32 row count followed by every column as
+	//   one sqlite type byte per row then its non-null values as int64, double, or
+	//   uint32 length and bytes for text and blobs.
+	//   A group with 0 rows ends the file.
+	inline size_t export_binary(sqlite3_stmt* stmt, file_writer& w, uint32_t group = 1 << 16)
+	{
+		const int c = sqlite3_column_count(stmt);
+		w.write("XLLSQLB1");
+		w.raw(static_cast<uint32_t>(c));
+		for (int j = 0; j < c; ++j) {
+			const std::string_view name = sqlite3_column_name(stmt, j);
+			w.raw(static_cast<uint32_t>(name.size()));
+			w.write(name);
+		}
+
+		// reused for every group
+		std::vector<std::vector<char>> types(c), values(c);
+		const auto append = [](std::vector<char>& v, const void* p, size_t n) {
+			const auto b = static_cast<const char*>(p);
+			v.insert(v.end(), b, b + n);
+		};
+		uint32_t n = 0;
+		const auto flush = [&]() {
+			w.raw(n);
+			for (int j = 0; j < c; ++j) {
+				w.write(types[j].data(), types[j].size());
+				w.write(values[j].data(), values[j].size());
+				types[j].clear();
+				values[j].clear();
+			}
+			n = 0;
+		};
+
+		size_t rows = 0;
+		int ret;
+		while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+			for (int j = 0; j < c; ++j) {
+				const int t = sqlite3_column_type(stmt, j);
+				types[j].push_back(static_cast<char>(t));
+				switch (t) {
+				case SQLITE_INTEGER: {
+					const sqlite3_int64 i = sqlite3_column_int64(stmt, j);
+					append(values[j], &i, sizeof(i));
+					break;
+				}
+				case SQLITE_FLOAT: {
+					const double d = sqlite3_column_double(stmt, j);
+					append(values[j], &d, sizeof(d));
+					break;
+				}
+				case SQLITE_TEXT:
+				case SQLITE_BLOB: {
+					const void* p = t == SQLITE_TEXT ? sqlite3_column_text(stmt, j) : sqlite3_column_blob(stmt, j);
+					const uint32_t len = static_cast<uint32_t>(sqlite3_column_bytes(stmt, j));
+					append(values[j], &len, sizeof(len));
+					append(values[j], p, len);
+					break;
+				}
+				}
+			}
+			++rows;
+			if (++n == group) {
+				flush();
+			}
+		}
+		FMS_SQLITE_OK(sqlite3_db_handle(stmt), ret == SQLITE_DONE ? SQLITE_OK : ret);
+		if (n) {
+			flush();
+		}
+		flush(); // end marker
+
+		return rows;
+	}
+
+	struct export_stats {
+		size_t rows = 0;
+		size_t bytes = 0;
+		double seconds = 0;
+	};
+
+	// Step stmt from the start and write every row to file in format.
+	inline export_stats export_stmt(sqlite3_stmt* stmt, const char* file, export_format format)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		export_stats s;
+
+		sqlite3_reset(stmt);
+		{
+			file_writer w(file);
+			switch (format) {
+			case export_format::csv:
+				s.rows = export_csv(stmt, w);
+				break;
+			case export_format::jsonl:
+				s.rows = export_jsonl(stmt, w);
+				break;
+			case export_format::binary:
+				s.rows = export_binary(stmt, w);
+				break;
+			}
+			w.flush();
+			s.bytes = w.bytes();
+		}
+		sqlite3_reset(stmt);
+		s.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		return s;
+	}
+
+} // namespace xll
@@ -0,0 +1,383 @@
+// xll_sqlite_import.cpp - load delimited text files into tables without going through Excel
+#include <charconv>
+#include <cmath>
+#include <exception>
+#include <thread>
+#include <type_traits>
+#include "win_file_view.h"
+#include "xll_csv.h"
+#include "xll_sqlite.h"
+
+using namespace xll;
+
+namespace {
+
+	struct import_options : csv::options {
+		bool append = false; // keep an existing table
+		unsigned sample = 1000; // records used to guess column types
+		unsigned threads = 0; // parsing threads
+	};
+
+	// Options from a two column range of keys and values.
+	import_options to_import_options(const OPER& o, const char* file)
+	{
+		import_options io;
+		const std::string_view f(file);
+		if (f.ends_with(".tsv") || f.ends_with(".tab") || f.ends_with(".TSV") || f.ends_with(".TAB")) {
+			io.delim = '\t';
+		}
+		if (o.is_missing()) {
+			return io;
+		}
+
+		ensure(columns(o) == 2 || !"options must be a two column range of keys and values");
+		for (unsigned i = 0; i < rows(o); ++i) {
+			const auto key = to_string(o(i, 0));
+			const OPER& val = o(i, 1);
+			const auto flag = [&val]() { return isStr(val) ? to_string(val) != "FALSE" : asNum(val) != 0; };
+			if (_stricmp(key.c_str(), "delimiter") == 0) {
+				const auto d = to_string(val);
+				ensure(!d.empty() || !"delimiter must not be empty");
+				io.delim = _stricmp(d.c_str(), "tab") == 0 || d == "\\t" ? '\t' : d[0];
+			}
+			else if (_stricmp(key.c_str(), "quote") == 0) {
+				const auto q = to_string(val);
+				io.quote = q.empty() ? '\0' : q[0];
+			}
+			else if (_stricmp(key.c_str(), "header") == 0) {
+				io.header = flag();
+			}
+			else if (_stricmp(key.c_str(), "append") == 0) {
+				io.append = flag();
+			}
+			else if (_stricmp(key.c_str(), "sample") == 0) {
+				io.sample = static_cast<unsigned>(asNum(val));
+			}
+			else if (_stricmp(key.c_str(), "threads") == 0) {
+				io.threads = static_cast<unsigned>(asNum(val));
+			}
+			else {
+				ensure(!"options must be delimiter, quote, header, append, sample, or threads");
+			}
+		}
+
+		return io;
+	}
+
+	// All of s is a T. Text like nan or inf is not a number since sqlite stores NaN as NULL.
+	template<class T>
+	bool parse(std::string_view s, T& t)
+	{
+		const auto [p, ec] = std::from_chars(s.data(), s.data() + s.size(), t);
+		if (ec != std::errc{} || p != s.data() + s.size()) {
+			return false;
+		}
+		if constexpr (std::is_floating_point_v<T>) {
+			return std::isfinite(t);
+		}
+
+		return true;
+	}
+
+	// Digits with leading zeros, like zip codes or account numbers, that would be lost as a number.
+	bool leading_zeros(std::string_view s)
+	{
+		if (!s.empty() && (s[0] == '-' || s[0] == '+')) {
+			s.remove_prefix(1);
+		}
+
+		return s.size() > 1 && s[0] == '0' && '0' <= s[1] && s[1] <= '9';
+	}
+
+	// yyyy-mm-dd... or yyyy/mm/dd... that parse_time_t accepts.
+	bool parse_date(std::string_view s, time_t* pt)
+	{
+		const auto digit = [](char c) { return '0' <= c && c <= '9'; };
+		if (s.size() < 8 || !digit(s[0]) || !digit(s[1]) || !digit(s[2]) || !digit(s[3]) || (s[4] != '-' && s[4] != '/')) {
+			return false;
+		}
+
+		return parse_time_t(s.data(), s.size(), pt);
+	}
+
+	// Extended sqlite type of a field. Unlike guess_one_sqltype for cells, numbers are never
+	// taken to be Excel dates and integers are 64 bit. Numbers with leading zeros are text.
+	int sqltype(const csv::field& f)
+	{
+		if (f.empty()) {
+			return SQLITE_NULL;
+		}
+
+		const auto s = f.view();
+		if (s.size() == 1 && std::string_view("YyNnTtFf").find(s[0]) != std::string_view::npos) {
+			return SQLITE_BOOLEAN;
+		}
+		if (!leading_zeros(s)) {
+			sqlite3_int64 i;
+			if (parse(s, i)) {
+				return SQLITE_INTEGER;
+			}
+			double d;
+			if (parse(s, d)) {
+				return SQLITE_FLOAT;
+			}
+		}
+		time_t t;
+		if (parse_date(s, &t)) {
+			return SQLITE_DATETIME;
+		}
+
+		return SQLITE_TEXT;
+	}
+
+	// Append f to b as a value for a column of extended type t.
+	// Fields that do not have the type of the column are stored as text.
+	void encode(const csv::field& f, int t, char quote, encoded_block& b)
+	{
+		auto& v = b.values.emplace_back();
+		if (f.empty()) {
+			return;
+		}
+
+		const auto s = f.view();
+		if (t != SQLITE_TEXT && !f.escaped) {
+			time_t tt;
+			if (t == SQLITE_BOOLEAN && s.size() == 1 && std::string_view("YyNnTtFf").find(s[0]) != std::string_view::npos) {
+				v.type = SQLITE_INTEGER;
+				v.i = std::string_view("YyTt").find(s[0]) != std::string_view::npos;
+
+				return;
+			}
+			if (t == SQLITE_DATETIME && parse_date(s, &tt)) {
+				v.type = SQLITE_INTEGER;
+				v.i = tt;
+
+				return;
+			}
+			if (!leading_zeros(s)) {
+				if (parse(s, v.i)) {
+					v.type = SQLITE_INTEGER;
+
+					return;
+				}
+				if (parse(s, v.d)) {
+					v.type = SQLITE_FLOAT;
+
+					return;
+				}
+			}
+		}
+
+		v.type = SQLITE_TEXT;
+		v.off = b.text.size();
+		f.append(b.text, quote);
+		v.len = static_cast<int>(b.text.size() - v.off);
+	}
+
+	// Parse the records in [p, e) into blocks of batch rows and push them on ring.
+	// The last block has fewer than batch rows, possibly none, to mark the end of the chunk.
+	// Return false if stopped or a block with an error was pushed.
+	bool produce(const char* p, const char* e, const csv::options& o, const std::vector<int>& type, size_t batch,
+		spsc_ring<encoded_block>& ring, const std::atomic<bool>& stop)
+	{
+		const size_t m = type.size();
+		std::vector<csv::field> fs;
+		encoded_block b;
+		b.values.reserve(batch * m);
+		const auto push = [&]() {
+			while (!ring.try_push(b)) {
+				if (stop) {
+					return false;
+				}
+				std::this_thread::yield();
+			}
+			b = encoded_block{};
+			b.values.reserve(batch * m);
+
+			return true;
+		};
+
+		try {
+			while (p < e) {
+				p = csv::record(p, e, o, fs);
+				if (fs.size() == 1 && fs[0].empty()) {
+					continue; // blank line
+				}
+				const size_t c = std::min(fs.size(), m);
+				for (size_t j = 0; j < c; ++j) {
+					encode(fs[j], type[j], o.quote, b);
+				}
+				b.values.resize(b.values.size() + m - c);
+				if (++b.rows == batch && !push()) {
+					return false;
+				}
+			}
+		}
+		catch (...) {
+			b.error = std::current_exception();
+			push();
+
+			return false;
+		}
+
+		return push();
+	}
+
+	// Import file into table and return the number of rows inserted.
+	// Chunks of the file are parsed on worker threads in parallel and inserted
+	// in file order by this thread using multi-row VALUES statements.
+	sqlite3_int64 import(sqlite3* db, const char* table, const char* file, const import_options& o)
+	{
+		const Win::file_view view(file);
+		const char* b = csv::skip_bom(view.begin(), view.end());
+		const char* e = view.end();
+		ensure(b < e || !"file is empty");
+
+		// column names
+		std::vector<csv::field> fs;
+		const char* data = csv::record(b, e, o, fs);
+		const size_t m = fs.size();
+		std::vector<std::string> names(m);
+		for (size_t j = 0; j < m; ++j) {
+			names[j] = o.header ? fs[j].to_string(o.quote) : "";
+			if (names[j].empty()) {
+				names[j] = "col" + std::to_string(j);
+			}
+		}
+		if (!o.header) {
+			data = b;
+		}
+
+		unsigned workers = o.threads ? o.threads : std::max(2u, std::thread::hardware_concurrency()) - 1;
+		const auto cs = csv::chunks(data, e, 4 * workers, o.quote);
+		const size_t chunks = cs.size() - 1;
+		workers = static_cast<unsigned>(std::min<size_t>(workers, chunks));
+
+		// guess types from records at the start of each chunk
+		std::vector<type_lattice> ts(m);
+		const size_t per = std::max<size_t>(1, o.sample / chunks);
+		for (size_t k = 0; k < chunks; ++k) {
+			const char* p = cs[k];
+			for (size_t i = 0; i < per && p < cs[k + 1]; ++i) {
+				p = csv::record(p, cs[k + 1], o, fs);
+				for (size_t j = 0; j < std::min(fs.size(), m); ++j) {
+					if (!fs[j].empty()) {
+						// once a column has text later fields are counted as text without parsing them
+						ts[j].add(ts[j].has(SQLITE_TEXT) ? SQLITE_TEXT : sqltype(fs[j]));
+					}
+				}
+			}
+		}
+		std::vector<int> type(m);
+		for (size_t j = 0; j < m; ++j) {
+			type[j] = ts[j].type() == SQLITE_NULL ? SQLITE_TEXT : ts[j].type();
+		}
+
+		const std::string name = sqlite::table_name(table);
+		savepoint sp(db);
+
+		{
+			std::string ct = std::string(o.append ? "CREATE TABLE IF NOT EXISTS " : "CREATE TABLE ") + name + " (";
+			for (size_t j = 0; j < m; ++j) {
+				ct.append(j ? ", " : "").append(quote_name(names[j])).append(" ").append(sqlite::sqlname(type[j]));
+			}
+			ct.append(")");
+			if (!o.append) {
+				FMS_SQLITE_OK(db, sqlite3_exec(db, ("DROP TABLE IF EXISTS " + name).c_str(), NULL, NULL, NULL));
+				sync_forget(db, table);
+			}
+			FMS_SQLITE_OK(db, sqlite3_exec(db, ct.c_str(), NULL, NULL, NULL));
+		}
+
+		const size_t max_vars = sqlite3_limit(db, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+		const size_t batch = std::max<size_t>(max_vars / m, 1);
+		sqlite::stmt stmt(db), tail(db);
+		stmt.prepare(insert_values(name, m, batch));
+		size_t tail_rows = 0;
+		const auto insert = [db](sqlite::stmt& s, const encoded_block& b) {
+			bind(s, b);
+			const int ret = sqlite3_step(s);
+			FMS_SQLITE_OK(db, ret == SQLITE_DONE ? SQLITE_OK : ret);
+			s.reset();
+		};
+
+		std::vector<std::unique_ptr<spsc_ring<encoded_block>>> rings(workers);
+		for (auto& ring : rings) {
+			ring = std::make_unique<spsc_ring<encoded_block>>(4);
+		}
+		std::atomic<bool> stop = false;
+		sqlite3_int64 n = 0;
+		{
+			std::vector<std::jthread> producers;
+			stop_on_exit guard(stop);
+			for (unsigned w = 0; w < workers; ++w) {
+				producers.emplace_back([&, w]() {
+					for (size_t k = w; k < chunks && !stop; k += workers) {
+						if (!produce(cs[k], cs[k + 1], o, type, batch, *rings[w], stop)) {
+							return;
+						}
+					}
+				});
+			}
+
+			encoded_block blk;
+			for (size_t k = 0; k < chunks; ++k) {
+				auto& ring = *rings[k % workers];
+				do {
+					while (!ring.try_pop(blk)) {
+						std::this_thread::yield();
+					}
+					if (blk.error) {
+						std::rethrow_exception(blk.error);
+					}
+					if (blk.rows == batch) {
+						insert(stmt, blk);
+					}
+					else if (blk.rows) {
+						if (tail_rows != blk.rows) {
+							tail.prepare(insert_values(name, m, blk.rows));
+							tail_rows = blk.rows;
+						}
+						insert(tail, blk);
+					}
+					n += blk.rows;
+				} while (blk.rows == batch);
+			}
+		}
+
+		sp.release();
+
+		return n;
+	}
+
+} // namespace
+
+AddIn xai_sqlite_import(
+	Function(XLL_HANDLEX, "xll_sqlite_import", CATEGORY ".IMPORT")
+	.Arguments({
+		Arg(XLL_HANDLEX, "db", "is a handle to a sqlite database."),
+		Arg(XLL_CSTRING4, "table", "is the name of the table to create."),
+		Arg(XLL_CSTRING4, "file", "is the path of a CSV or TSV file."),
+		Arg(XLL_LPOPER, "_options", "is an optional two column range of delimiter, quote, header, append, sample, and threads keys and values."),
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Create a table from a delimited text file and return the database handle.")
+	.HelpTopic("https://www.sqlite.org/csv.html")
+);
+HANDLEX WINAPI xll_sqlite_import(HANDLEX db, const char* table, const char* file, LPOPER poptions)
+{
+#pragma XLLEXPORT
+	try {
+		handle<sqlite_db> db_(db);
+		ensure(db_);
+
+		import(*db_, table, file, to_import_options(*poptions, file));
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+
+		db = INVALID_HANDLEX;
+	}
+
+	return db;
+}
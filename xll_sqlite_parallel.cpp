@@ -0,0 +1,297 @@
+// xll_sqlite_parallel.cpp - partitioned scans over read-only connections
+#include <cctype>
+#include <exception>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include "xll_sqlite.h"
+
+using namespace xll;
+
+namespace {
+
+	// Rows and column names read by one partition.
+	struct partition {
+		std::vector<std::string> names;
+		std::vector<OPER> values; // row major
+		std::exception_ptr error;
+	};
+
+	// True if sql refers to table with a schema name, like main.table, which bypasses the view scan uses.
+	bool qualified(std::string_view sql, std::string_view table)
+	{
+		const auto ident = [](char c) { return isalnum(static_cast<unsigned char>(c)) || c == '_' || c & 0x80; };
+		for (size_t p = sql.find('.'); p != std::string_view::npos; p = sql.find('.', p + 1)) {
+			auto rest = sql.substr(p + 1);
+			while (!rest.empty() && isspace(static_cast<unsigned char>(rest[0]))) {
+				rest.remove_prefix(1);
+			}
+			if (!rest.empty() && (rest[0] == '[' || rest[0] == '"' || rest[0] == '`')) {
+				rest.remove_prefix(1);
+			}
+			if (rest.size() >= table.size() && 0 == _strnicmp(rest.data(), table.data(), table.size())
+				&& (rest.size() == table.size() || !ident(rest[table.size()]))) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Run sql on its own read-only connection to file with the rows of table restricted by where.
+	// A temporary view shadows the table so sql does not need to be rewritten.
+	// The view has the rowid of the table unless it is a WITHOUT ROWID table.
+	void scan(partition& part, const std::string& file, const std::string& sql,
+		const std::string& table, const std::string& where)
+	{
+		try {
+			sqlite::db db(file.c_str(), SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX);
+
+			sqlite3_stmt* probe = nullptr;
+			const bool rowid = SQLITE_OK == sqlite3_prepare_v2(db, ("SELECT rowid FROM main." + table).c_str(), -1, &probe, nullptr);
+			sqlite3_finalize(probe);
+
+			sqlite::stmt stmt(db);
+			stmt.exec("CREATE TEMP VIEW " + table + " AS SELECT " + (rowid ? "rowid AS rowid, *" : "*")
+				+ " FROM main." + table + " WHERE " + where);
+
+			stmt.prepare(sql);
+			const int c = stmt.column_count();
+			for (int j = 0; j < c; ++j) {
+				part.names.push_back(stmt.column_name(j));
+			}
+
+			const decoder_plan plan(stmt);
+			int ret;
+			while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+				plan.row(stmt, part.values);
+			}
+			FMS_SQLITE_OK(db, ret == SQLITE_DONE ? SQLITE_OK : ret);
+		}
+		catch (...) {
+			part.error = std::current_exception();
+		}
+	}
+
+	// How a column of partial results is combined.
+	enum class combine_op { group, sum, min, max };
+
+	combine_op to_combine_op(const OPER& o)
+	{
+		const auto s = to_string(o);
+		if (_stricmp(s.c_str(), "GROUP") == 0 || _stricmp(s.c_str(), "KEY") == 0) {
+			return combine_op::group;
+		}
+		if (_stricmp(s.c_str(), "SUM") == 0 || _stricmp(s.c_str(), "COUNT") == 0) {
+			return combine_op::sum;
+		}
+		if (_stricmp(s.c_str(), "MIN") == 0) {
+			return combine_op::min;
+		}
+		if (_stricmp(s.c_str(), "MAX") == 0) {
+			return combine_op::max;
+		}
+		ensure(!"combine must be one of GROUP, SUM, COUNT, MIN, or MAX");
+
+		return combine_op::group;
+	}
+
+	// Numbers sort before text like in sqlite. NULL and other values are not compared.
+	int rank(const OPER& x)
+	{
+		return isNum(x) ? 1 : isStr(x) ? 2 : 0;
+	}
+	// True if x sorts before y. Text is compared like the BINARY collation.
+	bool less(const OPER& x, const OPER& y)
+	{
+		if (rank(x) != rank(y)) {
+			return rank(x) < rank(y);
+		}
+
+		return isNum(x) ? x.val.num < y.val.num : to_string(x) < to_string(y);
+	}
+
+	// Merge row b into row a using ops.
+	void combine(OPER* a, const OPER* b, const std::vector<combine_op>& ops)
+	{
+		for (size_t j = 0; j < ops.size(); ++j) {
+			if (ops[j] == combine_op::group || !rank(b[j])) {
+				continue;
+			}
+			if (ops[j] == combine_op::sum) {
+				if (isNum(b[j])) {
+					a[j] = isNum(a[j]) ? OPER(a[j].val.num + b[j].val.num) : b[j];
+				}
+			}
+			else if (!rank(a[j])) {
+				a[j] = b[j];
+			}
+			else if (ops[j] == combine_op::min && less(b[j], a[j])) {
+				a[j] = b[j];
+			}
+			else if (ops[j] == combine_op::max && less(a[j], b[j])) {
+				a[j] = b[j];
+			}
+		}
+	}
+
+} // namespace
+
+AddIn xai_sqlite_query_parallel(
+	Function(XLL_LPXLOPER12, "xll_sqlite_query_parallel", CATEGORY ".QUERY.PARALLEL")
+	.Arguments({
+		Arg_db,
+		Arg_sql,
+		Arg(XLL_CSTRING4, "table", "is the name of the table to partition."),
+		Arg(XLL_CSTRING4, "_key", "is an optional column of INTEGER values, such as dates, to partition on. Default is rowid."),
+		Arg(XLL_LONG, "_threads", "is an optional number of partitions up to the number of cores. Default is the number of cores."),
+		Arg(XLL_LPOPER, "_combine", "is an optional range of GROUP, SUM, COUNT, MIN, or MAX for each result column."),
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Return result of executing sql over key ranges of table in parallel.")
+	.HelpTopic("https://www.sqlite.org/lang_createview.html")
+);
+LPXLOPER12 WINAPI xll_sqlite_query_parallel(HANDLEX db, const LPOPER12 psql, const char* table, const char* key, LONG threads, const LPOPER pcombine)
+{
+#pragma XLLEXPORT
+	mem::result<XLOPER12> result;
+
+	try {
+		handle<sqlite_db> db_(db);
+		ensure(db_);
+
+		const char* file = sqlite3_db_filename(*db_, "main");
+		ensure(file && *file || !"parallel queries require a database file");
+		{
+			std::lock_guard<std::mutex> lock(state(*db_).mutex);
+			ensure(connection::shareable(*db_)
+				|| !"parallel queries only see committed data: end the transaction and detach or drop temporary tables first");
+		}
+
+		const std::string sql = to_string(*psql, " ", " ");
+		ensure(!qualified(sql, table) || !"sql must refer to table without a schema name so each thread only scans its part");
+		const std::string name = sqlite::table_name(table);
+		const std::string k = *key ? quote_name(key) : std::string("rowid");
+		const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+		const size_t n = threads > 0 ? std::min(static_cast<size_t>(threads), cores) : cores;
+
+		// key range and rows the ranges do not cover
+		sqlite3_int64 lo = 0, hi = -1;
+		sqlite3_int64 nulls = 0;
+		{
+			sqlite::stmt stmt(*db_);
+			stmt.prepare("SELECT min(" + k + "), max(" + k + "), "
+				"count(*) FILTER (WHERE " + k + " IS NULL), "
+				"count(*) FILTER (WHERE typeof(" + k + ") NOT IN ('integer', 'null')) FROM " + name);
+			ensure(SQLITE_ROW == sqlite3_step(stmt));
+			ensure(0 == sqlite3_column_int64(stmt, 3) || !"key must be a column of INTEGER values");
+			if (SQLITE_NULL != sqlite3_column_type(stmt, 0)) {
+				lo = sqlite3_column_int64(stmt, 0);
+				hi = sqlite3_column_int64(stmt, 1);
+			}
+			nulls = sqlite3_column_int64(stmt, 2);
+		}
+
+		// half-open ranges [lo + off(i), lo + off(i + 1)) with off(i) = span*i/n
+		// in unsigned offsets so keys spanning all of int64 do not overflow
+		// and the last range has no upper bound so it includes hi
+		std::vector<std::string> where;
+		if (hi >= lo) {
+			const uint64_t span = static_cast<uint64_t>(hi) - static_cast<uint64_t>(lo);
+			const uint64_t q = span / n, r = span % n;
+			const auto bound = [&](size_t i) {
+				const uint64_t off = q * i + (r * i) / n;
+
+				return std::to_string(static_cast<sqlite3_int64>(static_cast<uint64_t>(lo) + off));
+			};
+			for (size_t i = 0; i < n; ++i) {
+				auto w = k + " >= " + bound(i);
+				if (i + 1 < n) {
+					w += " AND " + k + " < " + bound(i + 1);
+				}
+				where.push_back(w);
+			}
+		}
+		if (nulls) {
+			where.push_back(k + " IS NULL");
+		}
+		if (where.empty()) {
+			where.push_back("0"); // column names of an empty table
+		}
+
+		std::vector<partition> parts(where.size());
+		{
+			std::vector<std::jthread> workers;
+			for (size_t i = 0; i < parts.size(); ++i) {
+				workers.emplace_back(scan, std::ref(parts[i]), std::string(file), std::cref(sql),
+					std::cref(name), std::cref(where[i]));
+			}
+		} // join
+
+		for (const auto& part : parts) {
+			if (part.error) {
+				std::rethrow_exception(part.error);
+			}
+		}
+
+		const size_t c = parts[0].names.size();
+		auto& o = *result;
+		for (const auto& ni : parts[0].names) {
+			o.push_back(OPER(ni));
+		}
+
+		if (pcombine->is_missing()) {
+			for (const auto& part : parts) {
+				for (const auto& v : part.values) {
+					o.push_back(v);
+				}
+			}
+		}
+		else {
+			ensure(size(*pcombine) == c || !"combine must have one entry per column");
+			std::vector<combine_op> ops(c);
+			for (size_t j = 0; j < c; ++j) {
+				ops[j] = to_combine_op((*pcombine)[(int)j]);
+			}
+
+			// merge rows with equal group columns in order of first appearance
+			std::vector<std::vector<OPER>> merged;
+			std::map<std::string, size_t> index;
+			for (const auto& part : parts) {
+				for (size_t i = 0; i + c <= part.values.size(); i += c) {
+					const OPER* row = &part.values[i];
+					std::string g;
+					for (size_t j = 0; j < c; ++j) {
+						if (ops[j] == combine_op::group) {
+							g.append(to_string(row[j]));
+							g.push_back('\x1f');
+						}
+					}
+					auto [it, inserted] = index.try_emplace(g, merged.size());
+					if (inserted) {
+						merged.emplace_back(row, row + c);
+					}
+					else {
+						combine(merged[it->second].data(), row, ops);
+					}
+				}
+			}
+			for (const auto& row : merged) {
+				for (const auto& v : row) {
+					o.push_back(v);
+				}
+			}
+		}
+
+		if (c != 0 && o.size() > 1) {
+			o.resize(o.size() / c, c);
+		}
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+
+		*result = mem::OPER12(xlerrNA);
+	}
+
+	return result.release();
+}
@@ -0,0 +1,623 @@
+// xll_sqlite_range.h - virtual tables reading Excel data
+// SELECT * FROM xl_range(?) has columns c0, c1, ... for the range bound with sqlite3_bind_pointer.
+// CREATE VIRTUAL TABLE temp.t USING xl_range(id, px, qty) names the columns of t(?).
+// Numbers are only converted to dates in columns declared like xl_range(id, d DATETIME).
+// SELECT * FROM t WHERE id IN carray(?) reads an array bound with SQL.BIND.
+#pragma once
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "xll_sqlite.h"
+
+namespace xll::xl_range {
+
+	// Pointer type of ranges bound with sqlite3_bind_pointer.
+	inline constexpr const char* pointer_type = "xll_oper";
+	// Number of columns of the eponymous xl_range table.
+	inline constexpr int max_columns = 64;
+
+	// Bind range to 1-based parameter i of stmt. The range must outlive the statement's use of it.
+	inline int bind(sqlite3_stmt* stmt, int i, const OPER* range)
+	{
+		return sqlite3_bind_pointer(stmt, i, const_cast<OPER*>(range), pointer_type, nullptr);
+	}
+
+	// Cell (i, j) of a range or a single value.
+	inline const OPER& cell(const OPER& range, unsigned i, unsigned j)
+	{
+		return isMulti(range) ? range(i, j) : range;
+	}
+
+	// Result of a cell converted using extended type like xll::bind.
+	inline void result(sqlite3_context* ctx, const OPER& x, int type)
+	{
+		if (is_null(x)) {
+			sqlite3_result_null(ctx);
+
+			return;
+		}
+
+		if (type == SQLITE_DATETIME) {
+			if (isNum(x)) {
+				if (x.val.num == 0) {
+					sqlite3_result_null(ctx);
+				}
+				else if (possibly_num_date(x)) {
+					sqlite3_result_int64(ctx, datetime::to_time_t(x.val.num));
+				}
+				else {
+					sqlite3_result_double(ctx, x.val.num);
+				}
+
+				return;
+			}
+			if (isStr(x)) {
+				time_t t;
+				if (x.val.str[0] == 0) {
+					sqlite3_result_null(ctx);
+				}
+				else if (parse_time_t(x.val.str + 1, x.val.str[0], &t)) {
+					sqlite3_result_int64(ctx, t);
+				}
+				else {
+					sqlite3_result_text16(ctx, x.val.str + 1, 2 * x.val.str[0], SQLITE_STATIC);
+				}
+
+				return;
+			}
+		}
+		else if (type == SQLITE_BOOLEAN) {
+			if (isStr(x) && x.val.str[0] == 1) {
+				sqlite3_result_int(ctx, 0 != wcschr(L"YyTt", x.val.str[1]));
+
+				return;
+			}
+			if (isNum(x) || isBool(x) || isInt(x)) {
+				sqlite3_result_int(ctx, asNum(x) != 0);
+
+				return;
+			}
+		}
+
+		switch (xll::type(x)) {
+		case xltypeNum:
+			if (type == SQLITE_INTEGER && x.val.num == std::floor(x.val.num)) {
+				sqlite3_result_int64(ctx, static_cast<sqlite3_int64>(x.val.num));
+			}
+			else {
+				sqlite3_result_double(ctx, x.val.num);
+			}
+			break;
+		case xltypeInt:
+			sqlite3_result_int(ctx, x.val.w);
+			break;
+		case xltypeBool:
+			sqlite3_result_int(ctx, x.val.xbool);
+			break;
+		case xltypeStr:
+			// the range outlives the statement so the text is not copied
+			sqlite3_result_text16(ctx, x.val.str + 1, 2 * x.val.str[0], SQLITE_STATIC);
+			break;
+		default:
+			sqlite3_result_null(ctx);
+		}
+	}
+
+	// Extended type declared after the name in the column definition def, or 0 if none.
+	inline int declared_type(std::string_view def)
+	{
+		size_t i = 0;
+		if (!def.empty() && (def[0] == '[' || def[0] == '"' || def[0] == '`')) {
+			i = def.find(def[0] == '[' ? ']' : def[0], 1);
+			i = i == std::string_view::npos ? def.size() : i + 1;
+		}
+		else {
+			while (i < def.size() && !isspace(static_cast<unsigned char>(def[i]))) {
+				++i;
+			}
+		}
+
+		std::string d(def.substr(i));
+		std::transform(d.begin(), d.end(), d.begin(), [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+		const auto has = [&d](const char* s) { return d.find(s) != std::string::npos; };
+		if (has("DATE") || has("TIME")) {
+			return SQLITE_DATETIME;
+		}
+		if (has("BOOL")) {
+			return SQLITE_BOOLEAN;
+		}
+		if (has("INT")) {
+			return SQLITE_INTEGER;
+		}
+		if (has("CHAR") || has("CLOB") || has("TEXT")) {
+			return SQLITE_TEXT;
+		}
+		if (has("REAL") || has("FLOA") || has("DOUB") || has("NUM")) {
+			return SQLITE_FLOAT;
+		}
+
+		return 0;
+	}
+#ifdef _DEBUG
+	inline int test_declared_type()
+	{
+		try {
+			ensure(declared_type("id") == 0);
+			ensure(declared_type("id INTEGER") == SQLITE_INTEGER);
+			ensure(declared_type("d datetime") == SQLITE_DATETIME);
+			ensure(declared_type("[trade date] DATE") == SQLITE_DATETIME);
+			ensure(declared_type("[int date]") == 0);
+			ensure(declared_type("\"px\" REAL") == SQLITE_FLOAT);
+			ensure(declared_type("name VARCHAR(10)") == SQLITE_TEXT);
+		}
+		catch (const std::exception& ex) {
+			XLL_ERROR(ex.what());
+
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+#endif // _DEBUG
+
+	struct table : sqlite3_vtab {
+		int columns; // visible columns, followed by hidden range and headers
+		std::vector<int> declared; // extended type of each named column or 0
+	};
+
+	// Cursors live for one run of a statement so the type plan is only
+	// computed once when xl_range is the inner loop of a join.
+	struct cursor : sqlite3_vtab_cursor {
+		const OPER* range = nullptr;
+		unsigned row = 0;
+		unsigned rows = 0;
+		// type plan of range after row off
+		const OPER* planned = nullptr;
+		unsigned planned_off = 0;
+		std::vector<int> plan;
+
+		// Declared types win. Columns that only look like dates keep their numbers
+		// so keys such as 30000 are not read as time_t.
+		void choose_plan(unsigned columns, unsigned off, const std::vector<int>& declared)
+		{
+			if (range == planned && off == planned_off) {
+				return;
+			}
+
+			if (isMulti(*range)) {
+				plan = type_plan(*range, off);
+				plan.resize(std::min<size_t>(plan.size(), columns));
+			}
+			else {
+				plan.assign(1, guess_one_sqltype(*range));
+			}
+			for (size_t j = 0; j < plan.size(); ++j) {
+				if (j < declared.size() && declared[j]) {
+					plan[j] = declared[j];
+				}
+				else if (plan[j] == SQLITE_DATETIME) {
+					plan[j] = SQLITE_INTEGER;
+				}
+			}
+			planned = range;
+			planned_off = off;
+		}
+	};
+
+	// Bits of idxNum for the constraints used by xFilter.
+	enum { use_range = 1, use_headers = 2 };
+
+	inline int connect(sqlite3* db, void*, int argc, const char* const* argv, sqlite3_vtab** ppVtab, char** pzErr)
+	{
+		// argv[0] is the module, argv[1] the database, argv[2] the table, then the column names
+		std::string sql = "CREATE TABLE x(";
+		const int columns = argc > 3 ? argc - 3 : max_columns;
+		for (int j = 0; j < columns; ++j) {
+			sql.append(argc > 3 ? argv[3 + j] : "c" + std::to_string(j));
+			sql.append(", ");
+		}
+		sql.append("range HIDDEN, headers HIDDEN)");
+
+		int ret = sqlite3_declare_vtab(db, sql.c_str());
+		if (ret != SQLITE_OK) {
+			*pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+
+			return ret;
+		}
+
+		auto t = new (std::nothrow) table{};
+		if (!t) {
+			return SQLITE_NOMEM;
+		}
+		t->columns = columns;
+		for (int j = 3; j < argc; ++j) {
+			t->declared.push_back(declared_type(argv[j]));
+		}
+		*ppVtab = t;
+
+		return SQLITE_OK;
+	}
+
+	inline int disconnect(sqlite3_vtab* pVtab)
+	{
+		delete static_cast<table*>(pVtab);
+
+		return SQLITE_OK;
+	}
+
+	inline int best_index(sqlite3_vtab* pVtab, sqlite3_index_info* info)
+	{
+		const int columns = static_cast<table*>(pVtab)->columns;
+
+		int range = -1, headers = -1;
+		for (int i = 0; i < info->nConstraint; ++i) {
+			const auto& c = info->aConstraint[i];
+			if (c.op != SQLITE_INDEX_CONSTRAINT_EQ) {
+				continue;
+			}
+			if (c.iColumn == columns) {
+				if (!c.usable) {
+					return SQLITE_CONSTRAINT;
+				}
+				range = i;
+			}
+			else if (c.iColumn == columns + 1 && c.usable) {
+				headers = i;
+			}
+		}
+
+		info->idxNum = 0;
+		if (range >= 0) {
+			info->idxNum |= use_range;
+			info->aConstraintUsage[range].argvIndex = 1;
+			info->aConstraintUsage[range].omit = 1;
+			if (headers >= 0) {
+				info->idxNum |= use_headers;
+				info->aConstraintUsage[headers].argvIndex = 2;
+				info->aConstraintUsage[headers].omit = 1;
+			}
+			info->estimatedCost = 1000;
+			info->estimatedRows = 1000;
+		}
+		else {
+			info->estimatedCost = 1e12; // no range to read
+		}
+
+		return SQLITE_OK;
+	}
+
+	inline int open(sqlite3_vtab*, sqlite3_vtab_cursor** ppCursor)
+	{
+		auto c = new (std::nothrow) cursor{};
+		if (!c) {
+			return SQLITE_NOMEM;
+		}
+		*ppCursor = c;
+
+		return SQLITE_OK;
+	}
+
+	inline int close(sqlite3_vtab_cursor* cur)
+	{
+		delete static_cast<cursor*>(cur);
+
+		return SQLITE_OK;
+	}
+
+	inline int filter(sqlite3_vtab_cursor* cur, int idxNum, const char*, int argc, sqlite3_value** argv)
+	{
+		auto c = static_cast<cursor*>(cur);
+		auto t = static_cast<table*>(cur->pVtab);
+
+		c->range = nullptr;
+		c->row = c->rows = 0;
+		if ((idxNum & use_range) && argc > 0) {
+			c->range = static_cast<const OPER*>(sqlite3_value_pointer(argv[0], pointer_type));
+		}
+		if (!c->range) {
+			return SQLITE_OK; // no rows
+		}
+
+		const unsigned off = (idxNum & use_headers) && argc > 1 && sqlite3_value_int(argv[1]) ? 1 : 0;
+		c->rows = isMulti(*c->range) ? c->range->rows() : 1;
+		c->row = std::min(off, c->rows);
+		try {
+			c->choose_plan(t->columns, off, t->declared);
+		}
+		catch (const std::exception& ex) {
+			sqlite3_free(t->zErrMsg);
+			t->zErrMsg = sqlite3_mprintf("%s", ex.what());
+
+			return SQLITE_ERROR;
+		}
+
+		return SQLITE_OK;
+	}
+
+	inline int next(sqlite3_vtab_cursor* cur)
+	{
+		++static_cast<cursor*>(cur)->row;
+
+		return SQLITE_OK;
+	}
+
+	inline int eof(sqlite3_vtab_cursor* cur)
+	{
+		auto c = static_cast<cursor*>(cur);
+
+		return c->row >= c->rows;
+	}
+
+	inline int column(sqlite3_vtab_cursor* cur, sqlite3_context* ctx, int j)
+	{
+		auto c = static_cast<cursor*>(cur);
+
+		if (j < 0 || static_cast<size_t>(j) >= c->plan.size()) {
+			sqlite3_result_null(ctx); // hidden or past the last column of the range
+		}
+		else {
+			result(ctx, cell(*c->range, c->row, j), c->plan[j]);
+		}
+
+		return SQLITE_OK;
+	}
+
+	inline int rowid(sqlite3_vtab_cursor* cur, sqlite_int64* pRowid)
+	{
+		*pRowid = static_cast<cursor*>(cur)->row;
+
+		return SQLITE_OK;
+	}
+
+	inline const sqlite3_module module = {
+		.iVersion = 0,
+		.xCreate = connect, // also allow CREATE VIRTUAL TABLE to name columns
+		.xConnect = connect,
+		.xBestIndex = best_index,
+		.xDisconnect = disconnect,
+		.xDestroy = disconnect,
+		.xOpen = open,
+		.xClose = close,
+		.xFilter = filter,
+		.xNext = next,
+		.xEof = eof,
+		.xColumn = column,
+		.xRowid = rowid,
+	};
+
+	// Make xl_range available on db.
+	inline int create_module(sqlite3* db)
+	{
+		return sqlite3_create_module_v2(db, "xl_range", &module, nullptr, nullptr);
+	}
+
+} // namespace xll::xl_range
+
+namespace xll::carray {
+
+	// Pointer type of arrays bound with sqlite3_bind_pointer.
+	inline constexpr const char* pointer_type = "xll_array";
+
+	// Copy of the cells of a range owned by the statement it is bound to.
+	// Numbers are converted once when bound, not each time they are read.
+	struct array {
+		enum { integer, real, mixed } kind;
+		std::vector<sqlite3_int64> ints;
+		std::vector<double> nums;
+		std::vector<OPER> values;
+
+		explicit array(const OPER& x)
+		{
+			const unsigned n = xll::size(x);
+
+			kind = integer;
+			for (unsigned i = 0; i < n && kind != mixed; ++i) {
+				if (!isNum(x[i])) {
+					kind = mixed;
+				}
+				else if (x[i].val.num != std::floor(x[i].val.num) || std::fabs(x[i].val.num) > 9007199254740992.) {
+					kind = real;
+				}
+			}
+
+			if (kind == integer) {
+				ints.reserve(n);
+				for (unsigned i = 0; i < n; ++i) {
+					ints.push_back(static_cast<sqlite3_int64>(x[i].val.num));
+				}
+			}
+			else if (kind == real) {
+				nums.reserve(n);
+				for (unsigned i = 0; i < n; ++i) {
+					nums.push_back(x[i].val.num);
+				}
+			}
+			else {
+				values.reserve(n);
+				for (unsigned i = 0; i < n; ++i) {
+					values.push_back(x[i]);
+				}
+			}
+		}
+
+		size_t size() const
+		{
+			return kind == integer ? ints.size() : kind == real ? nums.size() : values.size();
+		}
+	};
+
+	inline void destroy(void* p)
+	{
+		delete static_cast<array*>(p);
+	}
+
+	// Bind a copy of the cells of x to 1-based parameter i of stmt.
+	inline int bind(sqlite3_stmt* stmt, int i, const OPER& x)
+	{
+		auto a = std::make_unique<array>(x);
+
+		// sqlite calls destroy even if binding fails
+		return sqlite3_bind_pointer(stmt, i, a.release(), pointer_type, destroy);
+	}
+
+	struct cursor : sqlite3_vtab_cursor {
+		const array* a = nullptr;
+		size_t row = 0;
+	};
+
+	enum { column_value, column_pointer };
+
+	inline int connect(sqlite3* db, void*, int, const char* const*, sqlite3_vtab** ppVtab, char**)
+	{
+		int ret = sqlite3_declare_vtab(db, "CREATE TABLE x(value, pointer HIDDEN)");
+		if (ret != SQLITE_OK) {
+			return ret;
+		}
+
+		auto t = new (std::nothrow) sqlite3_vtab{};
+		if (!t) {
+			return SQLITE_NOMEM;
+		}
+		*ppVtab = t;
+
+		return SQLITE_OK;
+	}
+
+	inline int disconnect(sqlite3_vtab* pVtab)
+	{
+		delete pVtab;
+
+		return SQLITE_OK;
+	}
+
+	inline int best_index(sqlite3_vtab*, sqlite3_index_info* info)
+	{
+		for (int i = 0; i < info->nConstraint; ++i) {
+			const auto& c = info->aConstraint[i];
+			if (c.iColumn == column_pointer && c.op == SQLITE_INDEX_CONSTRAINT_EQ) {
+				if (!c.usable) {
+					return SQLITE_CONSTRAINT;
+				}
+				info->aConstraintUsage[i].argvIndex = 1;
+				info->aConstraintUsage[i].omit = 1;
+				info->idxNum = 1;
+				info->estimatedCost = 100;
+				info->estimatedRows = 100;
+
+				return SQLITE_OK;
+			}
+		}
+		info->idxNum = 0;
+		info->estimatedCost = 1e12; // no array to read
+
+		return SQLITE_OK;
+	}
+
+	inline int open(sqlite3_vtab*, sqlite3_vtab_cursor** ppCursor)
+	{
+		auto c = new (std::nothrow) cursor{};
+		if (!c) {
+			return SQLITE_NOMEM;
+		}
+		*ppCursor = c;
+
+		return SQLITE_OK;
+	}
+
+	inline int close(sqlite3_vtab_cursor* cur)
+	{
+		delete static_cast<cursor*>(cur);
+
+		return SQLITE_OK;
+	}
+
+	inline int filter(sqlite3_vtab_cursor* cur, int idxNum, const char*, int argc, sqlite3_value** argv)
+	{
+		auto c = static_cast<cursor*>(cur);
+
+		c->a = idxNum && argc > 0 ? static_cast<const array*>(sqlite3_value_pointer(argv[0], pointer_type)) : nullptr;
+		c->row = 0;
+
+		return SQLITE_OK;
+	}
+
+	inline int next(sqlite3_vtab_cursor* cur)
+	{
+		++static_cast<cursor*>(cur)->row;
+
+		return SQLITE_OK;
+	}
+
+	inline int eof(sqlite3_vtab_cursor* cur)
+	{
+		auto c = static_cast<cursor*>(cur);
+
+		return !c->a || c->row >= c->a->size();
+	}
+
+	inline int column(sqlite3_vtab_cursor* cur, sqlite3_context* ctx, int j)
+	{
+		auto c = static_cast<cursor*>(cur);
+
+		if (j != column_value) {
+			sqlite3_result_null(ctx);
+		}
+		else if (c->a->kind == array::integer) {
+			sqlite3_result_int64(ctx, c->a->ints[c->row]);
+		}
+		else if (c->a->kind == array::real) {
+			sqlite3_result_double(ctx, c->a->nums[c->row]);
+		}
+		else {
+			xl_range::result(ctx, c->a->values[c->row], 0);
+		}
+
+		return SQLITE_OK;
+	}
+
+	inline int rowid(sqlite3_vtab_cursor* cur, sqlite_int64* pRowid)
+	{
+		*pRowid = static_cast<cursor*>(cur)->row;
+
+		return SQLITE_OK;
+	}
+
+	inline const sqlite3_module module = {
+		.iVersion = 0,
+		.xCreate = nullptr, // eponymous only
+		.xConnect = connect,
+		.xBestIndex = best_index,
+		.xDisconnect = disconnect,
+		.xDestroy = disconnect,
+		.xOpen = open,
+		.xClose = close,
+		.xFilter = filter,
+		.xNext = next,
+		.xEof = eof,
+		.xColumn = column,
+		.xRowid = rowid,
+	};
+
+	// Make carray available on db.
+	inline int create_module(sqlite3* db)
+	{
+		return sqlite3_create_module_v2(db, "carray", &module, nullptr, nullptr);
+	}
+
+} // namespace xll::carray
+
+namespace xll {
+
+	// Make the virtual tables of the add-in available on db.
+	inline int create_modules(sqlite3* db)
+	{
+		int ret = xl_range::create_module(db);
+		if (ret == SQLITE_OK) {
+			ret = carray::create_module(db);
+		}
+
+		return ret;
+	}
+
+} // namespace xll
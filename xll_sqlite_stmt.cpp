@@ -1,6 +1,5 @@
 ﻿// xll_sqlite_stmt.cpp - Sqlite3 bindings.
-//#include <thread>
-#include "xll_sqlite.h"
+#include "xll_sqlite_export.h"
 
 using namespace xll;
 
@@ -18,9 +17,9 @@ HANDLEX WINAPI xll_sqlite_stmt(HANDLEX db)
 	HANDLEX result = INVALID_HANDLEX;
 
 	try {
-		handle<sqlite::db> db_(db);
+		handle<sqlite_db> db_(db);
 		ensure(db_);
-		handle<sqlite::stmt> stmt_(new sqlite::stmt(*db_));
+		handle<sqlite_stmt> stmt_(new sqlite_stmt(*db_));
 		ensure(stmt_);
 
 		result = stmt_.get();
@@ -49,7 +48,7 @@ LPOPER WINAPI xll_sqlite_stmt_sql(HANDLEX stmt, BOOL expanded)
 
 	try {
 		result = ErrNA;
-		handle<sqlite::stmt> stmt_(stmt);
+		handle<sqlite_stmt> stmt_(stmt);
 		ensure(stmt_);
 
 		if (expanded) {
@@ -81,7 +80,7 @@ HANDLEX WINAPI xll_sqlite_stmt_db_handle(HANDLEX stmt)
 	HANDLEX result = INVALID_HANDLEX;
 
 	try {
-		handle<sqlite::stmt> stmt_(stmt);
+		handle<sqlite_stmt> stmt_(stmt);
 		ensure(stmt_);
 
 		result = to_handle<sqlite3>(stmt_->db_handle());
@@ -109,7 +108,7 @@ LPOPER WINAPI xll_sqlite_stmt_errmsg(HANDLEX stmt)
 
 	try {
 		result = ErrNA;
-		handle<sqlite::stmt> stmt_(stmt);
+		handle<sqlite_stmt> stmt_(stmt);
 		ensure(stmt_);
 
 		result = stmt_->errmsg();
@@ -136,7 +135,7 @@ double WINAPI xll_sqlite_stmt_column_count(HANDLEX stmt)
 	double result = INVALID_HANDLEX;
 
 	try {
-		handle<sqlite::stmt> stmt_(stmt);
+		handle<sqlite_stmt> stmt_(stmt);
 		ensure(stmt_);
 
 		result = stmt_->column_count();
@@ -165,7 +164,7 @@ LPOPER WINAPI xll_sqlite_stmt_column_name(HANDLEX stmt, LPOPER pi)
 
 	try {
 		result = ErrNA;
-		handle<sqlite::stmt> stmt_(stmt);
+		handle<sqlite_stmt> stmt_(stmt);
 		ensure(stmt_);
 
 		if (pi->is_missing()) {
@@ -202,7 +201,7 @@ LPOPER WINAPI xll_sqlite_stmt_column_type(HANDLEX stmt, LPOPER pi)
 
 	try {
 		result = ErrNA;
-		handle<sqlite::stmt> stmt_(stmt);
+		handle<sqlite_stmt> stmt_(stmt);
 		ensure(stmt_);
 
 		if (pi->is_missing()) {
@@ -239,7 +238,7 @@ LPOPER WINAPI xll_sqlite_stmt_column_sqltype(HANDLEX stmt, LPOPER pi)
 
 	try {
 		result = ErrNA;
-		handle<sqlite::stmt> stmt_(stmt);
+		handle<sqlite_stmt> stmt_(stmt);
 		ensure(stmt_);
 
 		if (pi->is_missing()) {
@@ -275,11 +274,12 @@ HANDLEX WINAPI xll_sqlite_stmt_prepare(HANDLEX stmt, const LPOPER psql)
 	HANDLEX result = INVALID_HANDLEX;
 
 	try {
-		handle<sqlite::stmt> stmt_(stmt);
+		handle<sqlite_stmt> stmt_(stmt);
 		ensure(stmt_);
 
 		std::string sql = to_string(*psql, " ", " ");
 		stmt_->prepare(sql);
+		stmt_->cur = cursor{};
 
 		result = stmt;
 	}
@@ -299,7 +299,8 @@ AddIn xai_sqlite_stmt_bind(
 		})
 	.Uncalced()
 	.Category(CATEGORY)
-	.FunctionHelp("bind a value to indices in a statement.")
+	.FunctionHelp("bind a value to indices in a statement. "
+		"A single key with a range of values binds an array for use with carray(?).")
 	.HelpTopic("https://www.sqlite.org/c3ref/bind_blob.html")
 );
 HANDLEX WINAPI xll_sqlite_stmt_bind(HANDLEX stmt, const LPOPER pkey, const LPOPER pval)
@@ -308,12 +309,20 @@ HANDLEX WINAPI xll_sqlite_stmt_bind(HANDLEX stmt, const LPOPER pkey, const LPOPE
 	HANDLEX result = INVALID_HANDLEX;
 
 	try {
-		handle<sqlite::stmt> stmt_(stmt);
+		handle<sqlite_stmt> stmt_(stmt);
 		ensure(stmt_);
 
 		//stmt_->reset();
 		//stmt_->clear_bindings();
-		sqlite_bind(*stmt_, *pkey, *pval);
+		if (size(*pkey) == 1 && size(*pval) > 1) {
+			// array for IN carray(?)
+			const int i = bind_parameter_index(*stmt_, *pkey);
+			ensure(i != 0 || !"parameter index not found");
+			FMS_SQLITE_OK(stmt_->db_handle(), carray::bind(*stmt_, i, *pval));
+		}
+		else {
+			sqlite_bind(*stmt_, *pkey, *pval);
+		}
 		
 		result = stmt;
 	}
@@ -328,31 +337,157 @@ AddIn xai_sqlite_stmt_exec(
 	Function(XLL_LPOPER12, "xll_sqlite_stmt_exec", CATEGORY ".EXEC")
 	.Arguments({
 		Arg_stmt,
+		Arg(XLL_LPOPER, "_params", "is an optional range with one row of parameters for each execution. "
+			"Columns are bound by name if the first row has parameter names, otherwise by position."),
 		})
 	.Category(CATEGORY)
-	.FunctionHelp("Step throught a sqlite statement.")
+	.FunctionHelp("Step throught a sqlite statement or execute it once for each row of _params "
+		"and return the number of rows changed.")
 	.HelpTopic("https://www.sqlite.org/c3ref/exec.html")
 );
-LPOPER12 WINAPI xll_sqlite_stmt_exec(HANDLEX stmt)
+LPOPER12 WINAPI xll_sqlite_stmt_exec(HANDLEX stmt, const LPOPER pparams)
 {
 #pragma XLLEXPORT
-	static mem::XOPER<XLOPER12> result;
+	mem::result<XLOPER12> result;
 
 	try {
-		//result = ErrNA12;
-		handle<sqlite::stmt> stmt_(stmt);
+		handle<sqlite_stmt> stmt_(stmt);
 		ensure(stmt_);
 
-		result.reset();
 		stmt_->reset();
-		xll::headers(*stmt_, result);
-		xll::map(*stmt_, result);
+		stmt_->cur = cursor{};
+		if (!pparams->is_missing()) {
+			unsigned off;
+			const auto index = parameter_plan(*stmt_, *pparams, off);
+			const auto changes = executemany(*stmt_, *pparams, off, index);
+
+			*result = mem::OPER12(static_cast<double>(changes));
+		}
+		else {
+			xll::headers(*stmt_, *result);
+			xll::map(*stmt_, *result);
+		}
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+
+		*result = mem::OPER12(xlerrNA);
+	}
+
+	return (LPOPER12)result.release();
+}
+
+AddIn xai_sqlite_stmt_fetch(
+	Function(XLL_LPOPER12, "xll_sqlite_stmt_fetch", CATEGORY ".FETCH")
+	.Arguments({
+		Arg_stmt,
+		Arg(XLL_LONG, "n", "is the maximum number of rows to return."),
+		Arg(XLL_BOOL, "_headers", "is an optional boolean to include column names as the first row."),
+		Arg(XLL_LONG, "_offset", "is an optional number of rows to skip. Default is 0."),
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Return n rows of a statement starting at _offset. "
+		"Paging forward continues from the last call without rerunning the statement.")
+	.HelpTopic("https://www.sqlite.org/c3ref/step.html")
+);
+LPOPER12 WINAPI xll_sqlite_stmt_fetch(HANDLEX stmt, LONG n, BOOL headers, LONG offset)
+{
+#pragma XLLEXPORT
+	mem::result<XLOPER12> result;
+
+	try {
+		handle<sqlite_stmt> stmt_(stmt);
+		ensure(stmt_);
+		ensure(n >= 0);
+		ensure(offset >= 0);
+
+		// rows only depend on offset so recalculating returns the same page
+		auto& cur = stmt_->cur;
+		if (cur.rows == 0 || static_cast<size_t>(offset) < cur.rows) {
+			stmt_->reset();
+			cur = cursor{};
+		}
+		xll::skip(*stmt_, static_cast<size_t>(offset) - cur.rows, cur);
+		if (headers) {
+			xll::headers(*stmt_, *result);
+		}
+		xll::fetch(*stmt_, *result, n, cur);
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+
+		*result = mem::OPER12(xlerrNA);
+	}
+
+	return (LPOPER12)result.release();
+}
+
+AddIn xai_sqlite_stmt_cursor_state(
+	Function(XLL_LPOPER, "xll_sqlite_stmt_cursor_state", CATEGORY ".CURSOR_STATE")
+	.Arguments({
+		Arg_stmt,
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Return the number of rows read by SQL.FETCH and whether the statement is done.")
+);
+LPOPER WINAPI xll_sqlite_stmt_cursor_state(HANDLEX stmt)
+{
+#pragma XLLEXPORT
+	static OPER result;
+
+	try {
+		result = ErrNA;
+		handle<sqlite_stmt> stmt_(stmt);
+		ensure(stmt_);
+
+		const auto& cur = stmt_->cur;
+		result = OPER({
+			OPER("rows"), OPER((double)cur.rows),
+			OPER("done"), OPER(cur.done),
+		});
+		result.resize(2, 2);
 	}
 	catch (const std::exception& ex) {
 		XLL_ERROR(ex.what());
 	}
 
-	return (LPOPER12)&result;
+	return &result;
+}
+
+AddIn xai_sqlite_stmt_export(
+	Function(XLL_LPOPER, "xll_sqlite_stmt_export", CATEGORY ".EXPORT")
+	.Arguments({
+		Arg_stmt,
+		Arg(XLL_CSTRING4, "file", "is the path of the file to write."),
+		Arg(XLL_CSTRING4, "_format", "is an optional format of CSV, JSONL, or BINARY. Default is based on the file extension."),
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Write all rows of a statement to a file and return the number of rows, bytes, and seconds taken.")
+);
+LPOPER WINAPI xll_sqlite_stmt_export(HANDLEX stmt, const char* file, const char* format)
+{
+#pragma XLLEXPORT
+	static OPER result;
+
+	try {
+		result = ErrNA;
+		handle<sqlite_stmt> stmt_(stmt);
+		ensure(stmt_);
+
+		stmt_->cur = cursor{};
+		const auto s = export_stmt(*stmt_, file, to_export_format(format, file));
+		result = OPER({
+			OPER("rows"), OPER((double)s.rows),
+			OPER("bytes"), OPER((double)s.bytes),
+			OPER("seconds"), OPER(s.seconds),
+		});
+		result.resize(3, 2);
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+	}
+
+	return &result;
 }
 
 AddIn xai_sqlite_query(
@@ -360,34 +495,120 @@ AddIn xai_sqlite_query(
 	.Arguments({
 		Arg_db,
 		Arg_sql,
+		Arg(XLL_DOUBLE, "_timeout", "is an optional number of seconds after which the query is stopped."),
+		Arg(XLL_LONG, "_max_rows", "is an optional maximum number of rows to return."),
+		Arg(XLL_LPOPER, "_range", "is an optional range bound to the first parameter for use with xl_range(?)."),
 		})
+	.ThreadSafe()
 	.Category(CATEGORY)
-	.FunctionHelp("Return result of executing sql with optional binding.")
+	.FunctionHelp("Return result of executing sql with optional binding. Press Esc to stop a long query.")
 	.HelpTopic("https://www.sqlite.org/c3ref/query.html")
 );
-LPXLOPER12 WINAPI xll_sqlite_query(HANDLEX db, const LPOPER12 psql)
+LPXLOPER12 WINAPI xll_sqlite_query(HANDLEX db, const LPOPER12 psql, double timeout, LONG max_rows, const LPOPER prange)
 {
 #pragma XLLEXPORT
-	static mem::XOPER<XLOPER12> result;
+	mem::result<XLOPER12> result;
 
 	try {
-		result = ErrNA;
-		handle<sqlite::db> db_(db);
+		handle<sqlite_db> db_(db);
 		ensure(db_);
+		ensure(timeout >= 0);
+		ensure(max_rows >= 0);
 
-		sqlite::stmt stmt(*db_);
 		std::string sql = to_string(*psql, " ", " ");
-		stmt.prepare(sql);
-		
-		result.reset();
-		xll::headers(stmt, result);
-		xll::map(stmt, result);
+		connection conn(*db_);
+		auto& st = state(conn);
+		const auto key = result_cache::key(sql);
+		const auto v = st.version(conn);
+
+		// truncated results and results depending on a range are not cached
+		const bool cache = !max_rows && prange->is_missing();
+		if (auto cached = cache ? st.results.find(key, v) : nullptr) {
+			*result = mem::OPER12(front(*cached));
+		}
+		else {
+			auto stmt = st.stmts.get(conn, sql);
+			if (!prange->is_missing()) {
+				ensure(sqlite3_bind_parameter_count(*stmt) > 0 || !"sql must have a parameter for _range");
+				FMS_SQLITE_OK(conn, xl_range::bind(*stmt, 1, prange));
+			}
+
+			progress p;
+			p.timeout = timeout;
+			p.max_rows = max_rows;
+			p.check_abort = true;
+
+			xll::headers(*stmt, *result);
+			xll::map(*stmt, *result, p);
+			conn.last(p);
+
+			if (p.status == progress::timeout || p.status == progress::aborted) {
+				auto msg = std::string(__FUNCTION__ ": ") + progress::status_name[p.status]
+					+ " after " + std::to_string(p.vm_steps) + " virtual machine steps and "
+					+ std::to_string(p.rows) + " rows";
+				throw std::runtime_error(msg);
+			}
+
+			if (p.status == progress::completed && cache
+				&& sqlite3_stmt_readonly(*stmt) && stmt.deterministic()) {
+				st.results.put(key, v, *result);
+			}
+		}
 	}
 	catch (const std::exception& ex) {
 		XLL_ERROR(ex.what());
+
+		*result = mem::OPER12(xlerrNA);
 	}
 
-	return (LPXLOPER12)&result;
+	return result.release();
+}
+
+AddIn xai_sqlite_query_status(
+	Function(XLL_LPOPER, "xll_sqlite_query_status", CATEGORY ".QUERY_STATUS")
+	.Arguments({
+		Arg_db,
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Return status, rows, virtual machine steps, and seconds of the last SQL.QUERY.")
+	.HelpTopic("https://www.sqlite.org/c3ref/progress_handler.html")
+);
+LPOPER WINAPI xll_sqlite_query_status(HANDLEX db)
+{
+#pragma XLLEXPORT
+	static OPER result;
+
+	try {
+		result = ErrNA;
+		handle<sqlite_db> db_(db);
+		ensure(db_);
+
+		progress p;
+		{
+			auto& st = state(*db_);
+			std::lock_guard<std::mutex> lock(st.mutex);
+			p = st.last;
+		}
+		result = OPER({
+			OPER("status"), OPER(progress::status_name[p.status]),
+			OPER("rows"), OPER((double)p.rows),
+			OPER("vm_steps"), OPER((double)p.vm_steps),
+			OPER("elapsed"), OPER(p.elapsed),
+		});
+		result.resize(4, 2);
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+	}
+
+	return &result;
+}
+
+// Called by Excel for results returned with xlbitDLLFree set.
+void WINAPI xlAutoFree12(LPXLOPER12 px)
+{
+#pragma XLLEXPORT
+	mem::pool<XLOPER12>::instance().release(px);
 }
 
 AddIn xai_sqlite_stmt_explain(
@@ -406,7 +627,7 @@ LPOPER WINAPI xll_sqlite_stmt_explain(HANDLEX stmt)
 
 	try {
 		result = ErrNA;
-		handle<sqlite::stmt> stmt_(stmt);
+		handle<sqlite_stmt> stmt_(stmt);
 		ensure(stmt_);
 
 		auto sql = std::string("EXPLAIN QUERY PLAN ") + stmt_->sql();
@@ -422,32 +643,3 @@ LPOPER WINAPI xll_sqlite_stmt_explain(HANDLEX stmt)
 
 	return &result;
 }
-
-#if 0
-void execa(std::stop_token token, OPER12 x, OPER12 h)
-{
-	//std::this_thread::sleep_for(std::chrono::seconds(px->as_int()));
-	Sleep(1000 * x.as_int());
-	x.val.num *= 2;
-
-	int result;
-	XLOPER12 ret;
-	result = ::Excel12(xlAsyncReturn, &ret, 2, &h, &x);
-	result = result;
-}
-
-AddIn xai_execa(
-	Function(XLL_VOID, "xll_execa", "EXECA")
-	.Arguments({
-		Arg(XLL_LPOPER12, "x", "is x"),
-		})
-	.Asynchronous()
-	.ThreadSafe()
-);
-void WINAPI xll_execa(LPOPER12 px, LPOPER12 ph)
-{
-#pragma XLLEXPORT
-	std::jthread jt(execa, std::stop_token{}, *px, *ph);
-}
-
-#endif // 0
\ No newline at end of file
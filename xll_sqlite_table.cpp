@@ -10,17 +10,45 @@ AddIn xai_sqlite_types(
 	.Arguments({
 		Arg(XLL_LPOPER, "range", "is a range."),
 		Arg(XLL_LONG, "column", "is the range column to check."),
+		Arg(XLL_LONG, "_sample", "is an optional number of first rows and random rows to check. Default is all rows."),
+		Arg(XLL_BOOL, "_report", "is an optional boolean to return the type and confidence of every column."),
 		})
 	.Category(CATEGORY)
 	.FunctionHelp("Guess sqlite type of column.")
 );
-LPOPER WINAPI xll_sqlite_types(const LPOPER po, long column)
+LPOPER WINAPI xll_sqlite_types(const LPOPER po, long column, LONG sample, BOOL report)
 {
 #pragma XLLEXPORT
 	static OPER o;
 
-	int type = guess_sqltype(*po, column);
-	o = sqlite::sqlname(type);
+	try {
+		o = ErrNA;
+		ensure(sample >= 0);
+
+		const auto ts = infer_sqltypes(*po, 0, sample);
+		if (!report) {
+			ensure(0 <= column && column < (long)ts.size());
+			o = sqlite::sqlname(ts[column].type());
+		}
+		else {
+			// confidence is the fraction of non-null cells checked having the column type
+			const double n = static_cast<double>(sample_rows(rows(*po), 0, sample).size());
+			o = OPER({ OPER("column"), OPER("type"), OPER("confidence"), OPER("cells"), OPER("rows") });
+			for (unsigned j = 0; j < ts.size(); ++j) {
+				const auto& tj = ts[j];
+				const double cells = static_cast<double>(tj.cells());
+				o.push_back(OPER((double)j));
+				o.push_back(OPER(sqlite::sqlname(tj.type())));
+				o.push_back(OPER(cells ? tj.matches() / cells : 1.));
+				o.push_back(OPER(cells));
+				o.push_back(OPER(n));
+			}
+			o.resize(1 + (unsigned)ts.size(), 5);
+		}
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+	}
 
 	return &o;
 }
@@ -41,44 +69,26 @@ inline std::map<std::string,std::pair<int,int>> sqlite_types(sqlite3* db, const
 	return ts;
 }
 
-// insert row i
-inline void sqlite_insert(sqlite::stmt& stmt, const OPER& data, int i, const std::vector<int>& type )
-{
-	for (unsigned j = 0; j < data.columns(); ++j) {
-		xll::bind(stmt, j + 1, data(i, j), type[j]);
-	}
-	stmt.step();
-	stmt.reset();
-}
-
-inline void sqlite_insert_into(sqlite3* db, const char* table, const OPER& data, unsigned off = 0)
+inline void sqlite_insert_into(sqlite3* db, const char* table, const OPER& data, unsigned off = 0, bool bulk = false)
 {
 	const auto nt = sqlite_types(db, table);
-	
-	auto sql = std::string("INSERT INTO ")
-		+ sqlite::table_name(table)
-		+ " VALUES (?";
-	for (size_t i = 1; i < nt.size(); ++i) {
-		sql.append(", ?");
-	}
-	sql.append(")");
-	sqlite::stmt stmt(db);
-	stmt.prepare(sql);
 
 	std::vector<int> ts(nt.size());
 	for (const auto& [ni, ti] : nt) {
 		ts[ti.first] = ti.second;
 	}
 
-	sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
 	try {
-		for (unsigned i = off; i < data.rows(); ++i) {
-			sqlite_insert(stmt, data, i, ts);
+		if (bulk) {
+			const auto t = bulk_insert(db, table, data, off, ts);
+			std::lock_guard<std::mutex> lock(state(db).mutex);
+			state(db).bulk = t;
+		}
+		else {
+			insert_pipeline(db, sqlite::table_name(table), data, off, ts);
 		}
-		sqlite3_exec(db, "COMMIT TRANSACTION", NULL, NULL, NULL);
 	}
 	catch (const std::exception& ex) {
-		sqlite3_exec(db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
 		XLL_ERROR(ex.what());
 	}
 	catch (...) {
@@ -86,25 +96,197 @@ inline void sqlite_insert_into(sqlite3* db, const char* table, const OPER& data,
 	}
 }
 
+// FNV-1a hash of s.
+inline sqlite3_int64 fnv1a(std::string_view s)
+{
+	uint64_t h = 14695981039346656037ull;
+	for (unsigned char c : s) {
+		h ^= c;
+		h *= 1099511628211ull;
+	}
+
+	return static_cast<sqlite3_int64>(h);
+}
+
+// Make table match data by inserting, updating, and deleting only rows that changed.
+// Rows are identified by the key columns and their hashes are kept in xll_sync
+// along with the rowid they were written to. Nothing is done if the hash of data is unchanged.
+inline void sqlite_sync_into(sqlite3* db, const char* table, const OPER& data, const OPER& key)
+{
+	const auto nt = sqlite_types(db, table);
+	const size_t m = std::min<size_t>(nt.size(), data.columns());
+
+	std::vector<int> ts(nt.size());
+	std::vector<std::string> names(nt.size());
+	for (const auto& [ni, ti] : nt) {
+		ts[ti.first] = ti.second;
+		names[ti.first] = ni;
+	}
+
+	// key columns by name or 0-based index
+	std::vector<unsigned> kj;
+	for (unsigned i = 0; i < size(key); ++i) {
+		if (isStr(key[i])) {
+			auto k = nt.find(to_string(key[i]));
+			ensure(k != nt.end() || !"key column not found");
+			kj.push_back(k->second.first);
+		}
+		else {
+			kj.push_back(static_cast<unsigned>(asNum(key[i])));
+		}
+		ensure(kj.back() < m || !"key column out of range");
+	}
+
+	const auto exec = [db](const char* sql) {
+		FMS_SQLITE_OK(db, sqlite3_exec(db, sql, NULL, NULL, NULL));
+	};
+	exec("CREATE TABLE IF NOT EXISTS xll_sync(tbl TEXT, key BLOB, hash INTEGER, row INTEGER, PRIMARY KEY(tbl, key)) WITHOUT ROWID");
+	exec("CREATE TABLE IF NOT EXISTS xll_sync_range(tbl TEXT PRIMARY KEY, hash INTEGER)");
+
+	// hash of each row and of the whole range
+	const unsigned n = data.rows();
+	std::vector<sqlite3_int64> hash(n);
+	std::vector<std::string> keys(n);
+	std::string buf, all;
+	for (unsigned i = 0; i < n; ++i) {
+		buf.clear();
+		for (unsigned j = 0; j < m; ++j) {
+			append_key(buf, data(i, j));
+		}
+		hash[i] = fnv1a(buf);
+		for (unsigned j : kj) {
+			append_key(keys[i], data(i, j));
+		}
+		all.append(reinterpret_cast<const char*>(&hash[i]), sizeof(hash[i]));
+	}
+	const sqlite3_int64 range_hash = fnv1a(all);
+
+	sqlite::stmt stmt(db);
+	stmt.prepare("SELECT hash FROM xll_sync_range WHERE tbl = ?1");
+	sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+	if (SQLITE_ROW == sqlite3_step(stmt) && sqlite3_column_int64(stmt, 0) == range_hash) {
+		return; // nothing changed
+	}
+
+	// rows written by the last sync
+	std::unordered_map<std::string, std::pair<sqlite3_int64, sqlite3_int64>> stored; // key -> (hash, rowid)
+	stmt.prepare("SELECT key, hash, row FROM xll_sync WHERE tbl = ?1");
+	sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+	while (SQLITE_ROW == sqlite3_step(stmt)) {
+		const auto k = static_cast<const char*>(sqlite3_column_blob(stmt, 0));
+		stored.emplace(std::string(k, sqlite3_column_bytes(stmt, 0)),
+			std::make_pair(sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2)));
+	}
+
+	const auto name = sqlite::table_name(table);
+	// rows added or removed some other way make the recorded rowids meaningless
+	stmt.prepare(std::string("SELECT count(*) FROM ") + name);
+	const sqlite3_int64 count = SQLITE_ROW == sqlite3_step(stmt) ? sqlite3_column_int64(stmt, 0) : 0;
+	const bool stale = !stored.empty() && static_cast<size_t>(count) != stored.size();
+	if (stale) {
+		stored.clear();
+	}
+	// never delete rows this function did not write
+	ensure(!stored.empty() || count == 0 || !"table has rows not written by SQL.INSERT_INTO with a key. Start from an empty table.");
+
+	std::string set;
+	for (size_t j = 0; j < m; ++j) {
+		set.append(j ? ", [" : "[").append(names[j]).append("] = ?").append(std::to_string(j + 1));
+	}
+	sqlite::stmt ins(db), upd(db), del(db), put(db), drop(db);
+	ins.prepare(insert_values(name, nt.size(), 1));
+	upd.prepare(std::string("UPDATE ") + name + " SET " + set + " WHERE rowid = ?" + std::to_string(m + 1));
+	del.prepare(std::string("DELETE FROM ") + name + " WHERE rowid = ?1");
+	put.prepare("INSERT OR REPLACE INTO xll_sync(tbl, key, hash, row) VALUES (?1, ?2, ?3, ?4)");
+	drop.prepare("DELETE FROM xll_sync WHERE tbl = ?1 AND key = ?2");
+
+	const auto step = [db](sqlite::stmt& s) {
+		const int ret = sqlite3_step(s);
+		FMS_SQLITE_OK(db, ret == SQLITE_DONE ? SQLITE_OK : ret);
+		s.reset();
+	};
+
+	savepoint sp(db);
+	if (stale) {
+		sync_forget(db, table);
+	}
+
+	std::unordered_map<std::string_view, unsigned> seen;
+	for (unsigned i = 0; i < n; ++i) {
+		ensure(seen.emplace(keys[i], i).second || !"duplicate key");
+
+		auto s = stored.find(keys[i]);
+		sqlite3_int64 row;
+		if (s == stored.end()) {
+			for (unsigned j = 0; j < m; ++j) {
+				bind(ins, j + 1, data(i, j), ts[j], text_binding::in_place);
+			}
+			step(ins);
+			row = sqlite3_last_insert_rowid(db);
+		}
+		else if (s->second.first != hash[i]) {
+			row = s->second.second;
+			for (unsigned j = 0; j < m; ++j) {
+				bind(upd, j + 1, data(i, j), ts[j], text_binding::in_place);
+			}
+			sqlite3_bind_int64(upd, static_cast<int>(m + 1), row);
+			step(upd);
+		}
+		else {
+			continue; // unchanged
+		}
+
+		sqlite3_bind_text(put, 1, table, -1, SQLITE_STATIC);
+		sqlite3_bind_blob(put, 2, keys[i].data(), static_cast<int>(keys[i].size()), SQLITE_STATIC);
+		sqlite3_bind_int64(put, 3, hash[i]);
+		sqlite3_bind_int64(put, 4, row);
+		step(put);
+	}
+
+	for (const auto& [k, hr] : stored) {
+		if (!seen.contains(k)) {
+			sqlite3_bind_int64(del, 1, hr.second);
+			step(del);
+			sqlite3_bind_text(drop, 1, table, -1, SQLITE_STATIC);
+			sqlite3_bind_blob(drop, 2, k.data(), static_cast<int>(k.size()), SQLITE_STATIC);
+			step(drop);
+		}
+	}
+
+	stmt.prepare("INSERT OR REPLACE INTO xll_sync_range(tbl, hash) VALUES (?1, ?2)");
+	sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, range_hash);
+	step(stmt);
+
+	sp.release();
+}
+
 AddIn xai_sqlite_insert_table(
 	Function(XLL_HANDLEX, "xll_sqlite_insert_table", CATEGORY ".INSERT_INTO")
 	.Arguments({
 		Arg(XLL_HANDLEX, "db", "is a handle to a sqlite database."),
 		Arg(XLL_CSTRING4, "table", "is the name of the table."),
 		Arg(XLL_LPOPER, "data", "is a range of data or a handle to a sqlite cursor."),
+		Arg(XLL_BOOL, "_bulk", "is an optional boolean to use bulk load settings and rebuild indexes after inserting."),
+		Arg(XLL_LPOPER, "_key", "is an optional range of key column names or indexes to only write rows that changed."),
 		})
 	.Category(CATEGORY)
 	.FunctionHelp("Create a sqlite table in a database.")
 	.HelpTopic("https://www.sqlite.org/lang_insert.html")
 );
-HANDLEX WINAPI xll_sqlite_insert_table(HANDLEX db, const char* table, const LPOPER po)
+HANDLEX WINAPI xll_sqlite_insert_table(HANDLEX db, const char* table, const LPOPER po, BOOL bulk, const LPOPER pkey)
 {
 #pragma XLLEXPORT
 	try {
-		handle<sqlite::db> db_(db);
+		handle<sqlite_db> db_(db);
 		ensure(db_);
 	
-		sqlite_insert_into(*db_, table, *po);
+		if (pkey->is_missing()) {
+			sqlite_insert_into(*db_, table, *po, 0, bulk);
+		}
+		else {
+			sqlite_sync_into(*db_, table, *po, *pkey);
+		}
 	}
 	catch (const std::exception& ex) {
 		XLL_ERROR(ex.what());
@@ -115,6 +297,47 @@ HANDLEX WINAPI xll_sqlite_insert_table(HANDLEX db, const char* table, const LPOP
 	return db;
 }
 
+AddIn xai_sqlite_bulk_stats(
+	Function(XLL_LPOPER, "xll_sqlite_bulk_stats", CATEGORY ".BULK_STATS")
+	.Arguments({
+		Arg_db,
+		})
+	.Category(CATEGORY)
+	.FunctionHelp("Return seconds spent in each phase of the last bulk load.")
+	.HelpTopic("https://www.sqlite.org/pragma.html#pragma_optimize")
+);
+LPOPER WINAPI xll_sqlite_bulk_stats(HANDLEX db)
+{
+#pragma XLLEXPORT
+	static OPER result;
+
+	try {
+		result = ErrNA;
+		handle<sqlite_db> db_(db);
+		ensure(db_);
+
+		std::lock_guard<std::mutex> lock(state(*db_).mutex);
+		const auto& t = state(*db_).bulk;
+		result = OPER{};
+		for (int p = 0; p < bulk_timing::count; ++p) {
+			result.push_back(OPER(bulk_timing::phase_name[p]));
+			result.push_back(OPER(t.seconds[p]));
+		}
+		result.push_back(OPER("total"));
+		result.push_back(OPER(t.total()));
+		result.push_back(OPER("rows"));
+		result.push_back(OPER((double)t.rows));
+		result.push_back(OPER("indexes"));
+		result.push_back(OPER((double)t.indexes));
+		result.resize(bulk_timing::count + 3, 2);
+	}
+	catch (const std::exception& ex) {
+		XLL_ERROR(ex.what());
+	}
+
+	return &result;
+}
+
 // " (column type, ...)"
 inline std::string create_table(const OPER& columns, const OPER& types)
 {
@@ -140,16 +363,17 @@ AddIn xai_sqlite_create_table(
 		Arg(XLL_LPOPER, "data", "is a range of data."),
 		Arg(XLL_LPOPER, "columns", "is an optional range of column names."),
 		Arg(XLL_LPOPER, "types", "is an optional range of column types."),
+		Arg(XLL_BOOL, "_bulk", "is an optional boolean to use bulk load settings."),
 		})
 		.Category(CATEGORY)
 	.FunctionHelp("Create a sqlite table in a database and populate if data is not missing.")
 	.HelpTopic("https://www.sqlite.org/lang_createtable.html")
 );
-HANDLEX WINAPI xll_sqlite_create_table(HANDLEX db, const char* table, LPOPER pdata, LPOPER pcolumns, LPOPER ptypes)
+HANDLEX WINAPI xll_sqlite_create_table(HANDLEX db, const char* table, LPOPER pdata, LPOPER pcolumns, LPOPER ptypes, BOOL bulk)
 {
 #pragma XLLEXPORT
 	try {
-		handle<sqlite::db> db_(db);
+		handle<sqlite_db> db_(db);
 		ensure(db_);
 
 		const OPER& data = *pdata;
@@ -174,9 +398,10 @@ HANDLEX WINAPI xll_sqlite_create_table(HANDLEX db, const char* table, LPOPER pda
 		}
 
 		if (type.is_missing()) {
+			const auto plan = type_plan(data, row);
 			type.resize(1, data.columns());
 			for (unsigned j = 0; j < type.columns(); ++j) {
-				type[j] = guess_sqltype(data, j, data.rows() - row, row);
+				type[j] = plan[j];
 			}
 		}
 		else {
@@ -197,10 +422,11 @@ HANDLEX WINAPI xll_sqlite_create_table(HANDLEX db, const char* table, LPOPER pda
 
 		sqlite::stmt stmt(*db_);
 		stmt.exec(std::string("DROP TABLE IF EXISTS ") + sqlite::table_name(table));
+		sync_forget(*db_, table);
 		stmt.exec(ct);
 
 		if (!pdata->is_missing()) {
-			sqlite_insert_into(*db_, table, *pdata, row);
+			sqlite_insert_into(*db_, table, *pdata, row, bulk);
 		}
 	}
 	catch (const std::exception& ex) {
@@ -233,16 +459,17 @@ HANDLEX WINAPI xll_sqlite_create_table_as(HANDLEX db, const char* table, LPOPER
 {
 #pragma XLLEXPORT
 	try {
-		handle<sqlite::db> db_(db);
+		handle<sqlite_db> db_(db);
 		ensure(db_);
 
 		const auto dte = std::string("DROP TABLE IF EXISTS [") + table + "]";
 		FMS_SQLITE_OK(*db_, sqlite3_exec(*db_, dte.c_str(), 0, 0, 0));
+		sync_forget(*db_, table);
 
 		// not optimal. exec stmt???
 		std::string select;
 		if (pselect->is_num()) {
-			handle<sqlite::stmt> stmt_(pselect->as_num());
+			handle<sqlite_stmt> stmt_(pselect->as_num());
 			ensure(stmt_);
 			select = stmt_->sql();
 		}
@@ -1,21 +1,33 @@
 // xll_text.h - text functions
 #pragma once
+#include <charconv>
+#include <cmath>
+#include <string_view>
 #include "xll24/include/xll.h"
+#include "xll_utf.h"
 
 namespace xll {
 
+	// UTF-8 of the wn characters at ws, or up to the terminating null if wn is -1.
 	inline std::string wcstombs(const wchar_t* ws, int wn = -1)
 	{
-		int n = WideCharToMultiByte(CP_UTF8, 0, ws, wn, NULL, 0, NULL, NULL);
-		std::string s(n, '\0');
+		const size_t n = wn < 0 ? wcslen(ws) : static_cast<size_t>(wn);
+		// at most 3 bytes per UTF-16 code unit so one pass suffices
+		std::string s(3 * n, '\0');
+		s.resize(utf::to_utf8(ws, n, s.data()));
 
-		int n_ = WideCharToMultiByte(CP_UTF8, 0, ws, wn, s.data(), n, NULL, NULL);
-		ensure(n_ == n);
-		if (wn == -1) {
-			s.resize(--n); // remove terminating null
+		return s;
+	}
+
+	// UTF-8 of the wn characters at ws in a thread local buffer reused by every call.
+	// The view is valid until the next call on the same thread.
+	inline std::string_view wcstombs_view(const wchar_t* ws, int wn)
+	{
+		if (wn <= 0) {
+			return std::string_view{};
 		}
 
-		return s;
+		return utf::to_utf8_view(ws, static_cast<size_t>(wn));
 	}
 
 	// quote("ab{c", '{', '}') => "{ab\{c}"
@@ -64,23 +76,154 @@ namespace xll {
 	}
 
 
+	// Maximum number of characters to_chars_general writes.
+	inline constexpr size_t general_max = 16;
+
+	// Write x the way Excel's "General" format displays it and return the end of the output.
+	// Like TEXT(x, "General") numbers take at most 11 characters, plus one for the sign,
+	// switching to 6 significant digits in scientific notation when they do not fit.
+	inline char* to_chars_general(char* first, double x)
+	{
+		char* last = first + general_max;
+
+		if (x == 0) {
+			*first = '0';
+
+			return first + 1;
+		}
+		if (!std::isfinite(x)) {
+			static constexpr std::string_view num = "#NUM!";
+
+			return std::copy(num.begin(), num.end(), first);
+		}
+
+		const size_t width = x < 0 ? 12 : 11;
+		// remove trailing zeros of the fraction and the decimal point if nothing is left
+		const auto trim = [](char* b, char* e) {
+			const char* dot = std::find(b, e, '.');
+			if (dot == e) {
+				return e;
+			}
+			while (e[-1] == '0') {
+				--e;
+			}
+
+			return e[-1] == '.' ? e - 1 : e;
+		};
+		const auto fixed = [=](int precision) {
+			const auto [p, ec] = std::to_chars(first, last, x, std::chars_format::fixed, precision);
+
+			return ec == std::errc{} ? trim(first, p) : last + 1;
+		};
+
+		// shortest round trip when it is short enough
+		{
+			const auto [p, ec] = std::to_chars(first, last, x);
+			if (ec == std::errc{} && static_cast<size_t>(p - first) <= width && std::find(first, p, 'e') == p) {
+				return p;
+			}
+		}
+
+		const int e = static_cast<int>(std::floor(std::log10(std::fabs(x))));
+		char* p = last + 1;
+		if (-4 <= e && e <= -1) {
+			p = fixed(9); // 10 + e significant digits
+		}
+		else if (-9 <= e && e <= 10) {
+			p = fixed(e < 0 ? 12 : std::max(0, 9 - e));
+		}
+		if (static_cast<size_t>(p - first) <= width) {
+			return p;
+		}
+
+		// d.ddddde+xx
+		const auto [q, ec] = std::to_chars(first, last, x, std::chars_format::scientific, 5);
+		char* exp = std::find(first, q, 'e');
+		char* m = trim(first, exp);
+		*m++ = 'E';
+
+		return std::copy(exp + 1, q, m);
+	}
+
+	// Upper bound of the UTF-8 length of a cell.
+	inline size_t to_string_max(const OPER& o)
+	{
+		if (isStr(o)) {
+			return 3 * static_cast<size_t>(o.val.str[0]);
+		}
+		if (isNum(o)) {
+			return general_max;
+		}
+		if (isErr(o)) {
+			return std::string_view(xlerr_string(static_cast<xll::xlerr>(o.val.err))).size();
+		}
+
+		return isBool(o) ? 5 : 0;
+	}
+
+	// Write a cell at p and return the end of the output.
+	// There must be room for to_string_max(o) characters.
+	inline char* to_chars(char* p, const OPER& o)
+	{
+		if (isStr(o)) {
+			p += utf::to_utf8(o.val.str + 1, o.val.str[0], p);
+		}
+		else if (isNum(o)) {
+			p = to_chars_general(p, o.val.num);
+		}
+		else if (isBool(o)) {
+			const std::string_view b = o.val.xbool ? "TRUE" : "FALSE";
+			p = std::copy(b.begin(), b.end(), p);
+		}
+		else if (isErr(o)) {
+			const std::string_view e = xlerr_string(static_cast<xll::xlerr>(o.val.err));
+			p = std::copy(e.begin(), e.end(), p);
+		}
+
+		return p;
+	}
+
+	// Join the cells of a range with field separator fs and record separator rs.
+	// The output is sized once for the whole range and every cell is written in place.
+	inline std::string join(const OPER& o, const char* fs = 0, const char* rs = 0)
+	{
+		const std::string_view FS(fs ? fs : "");
+		const std::string_view RS(rs ? rs : "");
+		const int r = rows(o);
+		const int c = columns(o);
+
+		size_t n = (r > 0 ? r - 1 : 0) * RS.size() + (c > 0 ? c - 1 : 0) * r * FS.size();
+		for (int i = 0; i < r; ++i) {
+			for (int j = 0; j < c; ++j) {
+				n += to_string_max(o(i, j));
+			}
+		}
+
+		std::string s(n, '\0');
+		char* p = s.data();
+		for (int i = 0; i < r; ++i) {
+			if (i > 0) {
+				p = std::copy(RS.begin(), RS.end(), p);
+			}
+			for (int j = 0; j < c; ++j) {
+				if (j > 0) {
+					p = std::copy(FS.begin(), FS.end(), p);
+				}
+				p = to_chars(p, o(i, j));
+			}
+		}
+		s.resize(p - s.data());
+
+		return s;
+	}
+
 	// Convert OPER to string for SQL query.
 	inline std::string to_string(const OPER& o, const char* fs = 0, const char* rs = 0)
 	{
 		std::string s;
 
 		if (isMulti(o)) {
-			for (int i = 0; i < rows(o); ++i) {
-				if (rs && i > 0) {
-					s.append(rs);
-				}
-				for (int j = 0; j < columns(o); ++j) {
-					if (fs && j > 0) {
-						s.append(fs);
-					}
-					s.append(to_string(o(i, j)));
-				}
-			}
+			s = join(o, fs, rs);
 		}
 		else if (isStr(o)) {
 			s = wcstombs(o.val.str + 1, o.val.str[0]);
@@ -94,6 +237,10 @@ namespace xll {
 		else if (isErr(o)) {
 			s = xlerr_string(static_cast<xll::xlerr>(o.val.err));
 		}
+		else if (isNum(o)) {
+			char buf[general_max];
+			s.assign(buf, to_chars_general(buf, o.val.num));
+		}
 		else {
 			const auto& v = Excel(xlfText, o, OPER("General"));
 			s = wcstombs(v.val.str + 1, v.val.str[0]);
@@ -130,6 +277,27 @@ namespace xll {
 			std::string os = to_string(o);
 			ensure(os == "1.23");
 		}
+		{
+			const auto general = [](double x) {
+				char buf[general_max];
+
+				return std::string(buf, to_chars_general(buf, x));
+			};
+			ensure(general(0) == "0");
+			ensure(general(-2) == "-2");
+			ensure(general(0.1 + 0.2) == "0.3");
+			ensure(general(1. / 3) == "0.333333333");
+			ensure(general(-1. / 3) == "-0.333333333");
+			ensure(general(2. / 3) == "0.666666667");
+			ensure(general(0.0001234567891) == "0.000123457");
+			ensure(general(0.00001) == "0.00001");
+			ensure(general(1.5e-9) == "1.5E-09");
+			ensure(general(1234567890.12345) == "1234567890");
+			ensure(general(12345678901) == "12345678901");
+			ensure(general(123456789012) == "1.23457E+11");
+			ensure(general(1e20) == "1E+20");
+			ensure(general(-1.23e-100) == "-1.23E-100");
+		}
 		{
 			OPER o("foo");
 			std::string os = to_string(o);
@@ -0,0 +1,95 @@
+// xll_thread_pool.h - bounded pool of worker threads
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace xll {
+
+	// Fixed number of workers taking jobs from a bounded queue.
+	// Jobs are called with the index of the worker running them.
+	class thread_pool {
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<std::function<void(size_t)>> jobs;
+		std::vector<std::jthread> workers;
+		size_t max_jobs;
+		bool stop = false;
+
+		void run(size_t i)
+		{
+			while (true) {
+				std::function<void(size_t)> job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					cv.wait(lock, [this]() { return stop || !jobs.empty(); });
+					if (stop) {
+						return;
+					}
+					job = std::move(jobs.front());
+					jobs.pop_front();
+				}
+				job(i);
+			}
+		}
+	public:
+		// Default number of workers.
+		static size_t concurrency()
+		{
+			return std::max(2u, std::thread::hardware_concurrency() / 2);
+		}
+
+		explicit thread_pool(size_t n = concurrency(), size_t max_jobs = 1024)
+			: max_jobs(max_jobs)
+		{
+			workers.reserve(n);
+			for (size_t i = 0; i < n; ++i) {
+				workers.emplace_back([this, i]() { run(i); });
+			}
+		}
+		thread_pool(const thread_pool&) = delete;
+		thread_pool& operator=(const thread_pool&) = delete;
+		~thread_pool()
+		{
+			shutdown();
+		}
+
+		// Discard queued jobs and join workers once their current job returns.
+		void shutdown()
+		{
+			std::deque<std::function<void(size_t)>> discarded;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+				discarded.swap(jobs);
+			}
+			cv.notify_all();
+			workers.clear();
+		}
+
+		size_t size() const
+		{
+			return workers.size();
+		}
+
+		// Queue a job. Return false if the queue is full.
+		bool submit(std::function<void(size_t)> job)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (stop || jobs.size() >= max_jobs) {
+					return false;
+				}
+				jobs.push_back(std::move(job));
+			}
+			cv.notify_one();
+
+			return true;
+		}
+	};
+
+} // namespace xll
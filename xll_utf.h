@@ -0,0 +1,278 @@
+// xll_utf.h - UTF-8 and UTF-16 conversion without the Windows code page functions
+// Runs of ASCII are converted 16 or 32 characters at a time. Invalid input becomes
+// U+FFFD like MultiByteToWideChar and WideCharToMultiByte without MB_ERR_INVALID_CHARS.
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define XLL_UTF_SSE2
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define XLL_UTF_AVX2
+#endif
+#include "xll24/include/ensure.h"
+
+namespace xll::utf {
+
+	inline constexpr char32_t replacement = 0xFFFD;
+
+	// Length of the ASCII prefix of [s, s + n).
+	inline size_t ascii(const char* s, size_t n)
+	{
+		size_t i = 0;
+#ifdef XLL_UTF_AVX2
+		for (; i + 32 <= n; i += 32) {
+			const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+			if (_mm256_movemask_epi8(x)) {
+				break;
+			}
+		}
+#endif
+#ifdef XLL_UTF_SSE2
+		for (; i + 16 <= n; i += 16) {
+			const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+			if (_mm_movemask_epi8(x)) {
+				break;
+			}
+		}
+#endif
+		while (i < n && static_cast<unsigned char>(s[i]) < 0x80) {
+			++i;
+		}
+
+		return i;
+	}
+
+	// Convert UTF-8 to UTF-16 and return the number of code units written.
+	// out must have room for n code units.
+	template<class C>
+		requires (sizeof(C) == 2)
+	inline size_t to_utf16(const char* s, size_t n, C* out)
+	{
+		const auto u = reinterpret_cast<const unsigned char*>(s);
+		C* o = out;
+		size_t i = 0;
+
+		while (i < n) {
+#ifdef XLL_UTF_AVX2
+			for (; i + 32 <= n; i += 32, o += 32) {
+				const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(u + i));
+				if (_mm256_movemask_epi8(x)) {
+					break;
+				}
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(o), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(x)));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(o + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(x, 1)));
+			}
+#endif
+#ifdef XLL_UTF_SSE2
+			for (; i + 16 <= n; i += 16, o += 16) {
+				const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(u + i));
+				if (_mm_movemask_epi8(x)) {
+					break;
+				}
+				const __m128i zero = _mm_setzero_si128();
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(o), _mm_unpacklo_epi8(x, zero));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(o + 8), _mm_unpackhi_epi8(x, zero));
+			}
+#endif
+			if (i == n) {
+				break;
+			}
+
+			// one code point
+			const unsigned b0 = u[i];
+			const auto cont = [&](size_t k) { return i + k < n && (u[i + k] & 0xC0) == 0x80; };
+			char32_t c = replacement;
+			size_t len = 1;
+			if (b0 < 0x80) {
+				c = b0;
+			}
+			else if (b0 >= 0xC2 && b0 <= 0xDF) {
+				if (cont(1)) {
+					c = ((b0 & 0x1F) << 6) | (u[i + 1] & 0x3F);
+					len = 2;
+				}
+			}
+			else if (b0 >= 0xE0 && b0 <= 0xEF) {
+				// no overlong forms or surrogates
+				const unsigned lo = b0 == 0xE0 ? 0xA0 : 0x80;
+				const unsigned hi = b0 == 0xED ? 0x9F : 0xBF;
+				if (cont(1) && u[i + 1] >= lo && u[i + 1] <= hi && cont(2)) {
+					c = ((b0 & 0x0F) << 12) | ((u[i + 1] & 0x3F) << 6) | (u[i + 2] & 0x3F);
+					len = 3;
+				}
+			}
+			else if (b0 >= 0xF0 && b0 <= 0xF4) {
+				// no overlong forms or code points above U+10FFFF
+				const unsigned lo = b0 == 0xF0 ? 0x90 : 0x80;
+				const unsigned hi = b0 == 0xF4 ? 0x8F : 0xBF;
+				if (cont(1) && u[i + 1] >= lo && u[i + 1] <= hi && cont(2) && cont(3)) {
+					c = ((b0 & 0x07) << 18) | ((u[i + 1] & 0x3F) << 12) | ((u[i + 2] & 0x3F) << 6) | (u[i + 3] & 0x3F);
+					len = 4;
+				}
+			}
+			i += len;
+
+			if (c < 0x10000) {
+				*o++ = static_cast<C>(c);
+			}
+			else {
+				c -= 0x10000;
+				*o++ = static_cast<C>(0xD800 + (c >> 10));
+				*o++ = static_cast<C>(0xDC00 + (c & 0x3FF));
+			}
+		}
+
+		return static_cast<size_t>(o - out);
+	}
+
+	// Convert UTF-16 to UTF-8 and return the number of bytes written.
+	// out must have room for 3n bytes.
+	template<class C>
+		requires (sizeof(C) == 2)
+	inline size_t to_utf8(const C* s, size_t n, char* out)
+	{
+		const auto w = reinterpret_cast<const uint16_t*>(s);
+		char* o = out;
+		size_t i = 0;
+
+		while (i < n) {
+#ifdef XLL_UTF_AVX2
+			for (; i + 32 <= n; i += 32, o += 32) {
+				const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + i));
+				const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + i + 16));
+				const __m256i high = _mm256_and_si256(_mm256_or_si256(a, b), _mm256_set1_epi16(static_cast<short>(0xFF80)));
+				if (!_mm256_testz_si256(high, high)) {
+					break;
+				}
+				// packus interleaves 128-bit lanes so put them back in order
+				const __m256i x = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(o), x);
+			}
+#endif
+#ifdef XLL_UTF_SSE2
+			for (; i + 16 <= n; i += 16, o += 16) {
+				const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i));
+				const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i + 8));
+				const __m128i high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16(static_cast<short>(0xFF80)));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xFFFF) {
+					break;
+				}
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(o), _mm_packus_epi16(a, b));
+			}
+#endif
+			if (i == n) {
+				break;
+			}
+
+			// one code point
+			char32_t c = w[i++];
+			if (c >= 0xD800 && c <= 0xDFFF) {
+				if (c <= 0xDBFF && i < n && w[i] >= 0xDC00 && w[i] <= 0xDFFF) {
+					c = 0x10000 + ((c - 0xD800) << 10) + (w[i++] - 0xDC00);
+				}
+				else {
+					c = replacement;
+				}
+			}
+
+			if (c < 0x80) {
+				*o++ = static_cast<char>(c);
+			}
+			else if (c < 0x800) {
+				*o++ = static_cast<char>(0xC0 | (c >> 6));
+				*o++ = static_cast<char>(0x80 | (c & 0x3F));
+			}
+			else if (c < 0x10000) {
+				*o++ = static_cast<char>(0xE0 | (c >> 12));
+				*o++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+				*o++ = static_cast<char>(0x80 | (c & 0x3F));
+			}
+			else {
+				*o++ = static_cast<char>(0xF0 | (c >> 18));
+				*o++ = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+				*o++ = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+				*o++ = static_cast<char>(0x80 | (c & 0x3F));
+			}
+		}
+
+		return static_cast<size_t>(o - out);
+	}
+
+	// UTF-8 of s in a thread local buffer reused by every call.
+	// The view is valid until the next call on the same thread.
+	template<class C>
+		requires (sizeof(C) == 2)
+	inline std::string_view to_utf8_view(const C* s, size_t n)
+	{
+		static thread_local std::string buf;
+
+		if (buf.size() < 3 * n) {
+			buf.resize(3 * n);
+		}
+
+		return std::string_view(buf.data(), to_utf8(s, n, buf.data()));
+	}
+
+	// UTF-16 of s in a thread local buffer reused by every call.
+	// The view is valid until the next call on the same thread.
+	template<class C = wchar_t>
+		requires (sizeof(C) == 2)
+	inline std::basic_string_view<C> to_utf16_view(const char* s, size_t n)
+	{
+		static thread_local std::basic_string<C> buf;
+
+		if (buf.size() < n) {
+			buf.resize(n);
+		}
+
+		return std::basic_string_view<C>(buf.data(), to_utf16(s, n, buf.data()));
+	}
+
+#ifdef _DEBUG
+	inline int test_utf()
+	{
+		const auto round_trip = [](std::u16string_view s) {
+			std::string u8(3 * s.size(), '\0');
+			u8.resize(to_utf8(s.data(), s.size(), u8.data()));
+			std::u16string u16(u8.size(), u'\0');
+			u16.resize(to_utf16(u8.data(), u8.size(), u16.data()));
+
+			return u16 == s;
+		};
+		const auto utf8 = [](std::u16string_view s) {
+			std::string u8(3 * s.size(), '\0');
+			u8.resize(to_utf8(s.data(), s.size(), u8.data()));
+
+			return u8;
+		};
+		const auto utf16 = [](std::string_view s) {
+			std::u16string u16(s.size(), u'\0');
+			u16.resize(to_utf16(s.data(), s.size(), u16.data()));
+
+			return u16;
+		};
+
+		ensure(round_trip(u""));
+		ensure(round_trip(u"abc"));
+		ensure(round_trip(u"0123456789abcdef0123456789abcdef0123456789abcdef!"));
+		ensure(round_trip(u"0123456789abcdef\u00E9\u4E2D\U0001F600 0123456789abcdef0123456789abcdef"));
+		ensure(utf8(u"\u00E9") == "\xC3\xA9");
+		ensure(utf8(u"\u20AC") == "\xE2\x82\xAC");
+		ensure(utf8(u"\U0001F600") == "\xF0\x9F\x98\x80");
+		ensure(utf8(u"a\xD800z") == "a\xEF\xBF\xBDz"); // lone surrogate
+		ensure(utf16("\xC0\xAF") == u"\xFFFD\xFFFD"); // overlong
+		ensure(utf16("\xED\xA0\x80") == u"\xFFFD\xFFFD\xFFFD"); // encoded surrogate
+		ensure(utf16("\xF4\x90\x80\x80") == u"\xFFFD\xFFFD\xFFFD\xFFFD"); // above U+10FFFF
+		ensure(utf16("abc\xE2\x82") == u"abc\xFFFD\xFFFD"); // truncated
+		ensure(ascii("0123456789abcdef0123456789abcdef0123\x80", 37) == 36);
+
+		return 1;
+	}
+#endif // _DEBUG
+
+} // namespace xll::utf